@@ -0,0 +1,48 @@
+#include "../tests/loopback.h"
+#include <pthread.h>
+#include <ctime>
+
+// Streams FileBody sized messages between two Sessions on loopback and prints packets/s and
+// the CPU seconds the io thread running both ends spends per GB. The bench_batchio_single target
+// builds it with NETLIB_NO_BATCH_IO, one syscall per datagram, to compare against.
+
+static const int MESSAGES = 200000;
+static const int WINDOW = 2048;
+
+static double cpuSeconds(std::thread &thread) {
+    clockid_t clock;
+    timespec time{};
+    pthread_getcpuclockid(thread.native_handle(), &clock);
+    clock_gettime(clock, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    // Optional: batch size, send window in frames, largest packet (1400 keeps datagrams Ethernet sized).
+    if (argc > 1)
+        BATCH_SIZE = std::stoi(argv[1]);
+    if (argc > 2)
+        WINDOW_SIZE = std::stoi(argv[2]);
+    if (argc > 3)
+        MAX_PACKET_SIZE = std::stoi(argv[3]);
+    Loopback loopback;
+    SessionPair pair = loopback.pair(0);
+
+    double cpuStart = cpuSeconds(loopback.runner());
+    auto start = std::chrono::steady_clock::now();
+    loopback.stream({pair}, MESSAGES, WINDOW);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = cpuSeconds(loopback.runner()) - cpuStart;
+    double gigabytes = double(MESSAGES) * FILE_CHUNK_SIZE / 1e9;
+
+#ifdef NETLIB_BATCH_IO
+    std::cout << "batched, BATCH_SIZE " << BATCH_SIZE << "\n";
+#else
+    std::cout << "one datagram per syscall\n";
+#endif
+    std::cout << std::fixed << std::setprecision(0) << "  " << MESSAGES / elapsed << " packets/s, "
+              << std::setprecision(1) << gigabytes * 8 / elapsed * 1000 << " Mbit/s\n"
+              << "  " << std::setprecision(2) << cpu / gigabytes << " CPU s per GB, retransmits "
+              << pair.sender->getStats().retransmits << "\n";
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "../netlib.h"
+
+using namespace netlib;
+
+// Packs and unpacks FileBody messages the way the node does, once with the bulk vector path
+// and once element by element the way it used to be, and prints bytes/s for each.
+
+static const int MESSAGES = 200000;
+
+static double seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+static void report(const char *what, size_t bytes, std::chrono::steady_clock::duration d) {
+    std::cout << what << ": " << std::fixed << std::setprecision(1) << bytes / seconds(d) / 1e6 << " MB/s\n";
+}
+
+static void packBulk(Message<TypesEnum> &msg, const std::vector<char> &chunk) {
+    msg << chunk << uint16_t(7) << uint16_t(3);
+}
+
+static void unpackBulk(Message<TypesEnum> &msg, std::vector<char> &chunk) {
+    uint16_t handle, pieceNum;
+    msg >> handle >> pieceNum >> chunk;
+}
+
+static void packElements(Message<TypesEnum> &msg, const std::vector<char> &chunk) {
+    for (char item: chunk)
+        msg << item;
+    msg << uint32_t(chunk.size()) << uint16_t(7) << uint16_t(3);
+}
+
+static void unpackElements(Message<TypesEnum> &msg, std::vector<char> &chunk) {
+    uint16_t handle, pieceNum;
+    uint32_t sz;
+    msg >> handle >> pieceNum >> sz;
+    chunk.resize(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        msg >> chunk[sz - i - 1];
+}
+
+template<typename Pack, typename Unpack>
+static void run(const char *name, size_t chunkSize, Pack pack, Unpack unpack) {
+    std::vector<char> chunk(chunkSize), out;
+    std::iota(chunk.begin(), chunk.end(), 0);
+    std::vector<Message<TypesEnum>> msgs(1024);
+    std::chrono::steady_clock::duration packTime{}, unpackTime{};
+    for (int done = 0; done < MESSAGES; done += msgs.size()) {
+        auto start = std::chrono::steady_clock::now();
+        for (auto &msg: msgs) {
+            msg = Message<TypesEnum>(TypesEnum::FileBodyMsgType);
+            pack(msg, chunk);
+        }
+        auto packed = std::chrono::steady_clock::now();
+        for (auto &msg: msgs)
+            unpack(msg, out);
+        unpackTime += std::chrono::steady_clock::now() - packed;
+        packTime += packed - start;
+        if (out != chunk) {
+            std::cerr << name << ": round trip mismatch\n";
+            std::exit(1);
+        }
+    }
+    size_t bytes = size_t(MESSAGES) * chunkSize;
+    std::cout << name << " " << chunkSize << " B chunks\n";
+    report("  pack", bytes, packTime);
+    report("  unpack", bytes, unpackTime);
+}
+
+int main() {
+    for (size_t chunkSize: {size_t(FILE_CHUNK_SIZE), size_t(1400)}) {
+        run("per element", chunkSize, packElements, unpackElements);
+        run("bulk", chunkSize, packBulk, unpackBulk);
+    }
+    return 0;
+}
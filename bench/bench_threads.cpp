@@ -0,0 +1,29 @@
+#include "../tests/loopback.h"
+
+// Streams FileBody sized messages over many Session pairs on loopback that share one io_context,
+// run by 1, 2, 4... threads the way Server runs it with IO_THREADS, and prints the aggregate
+// throughput for each thread count.
+
+static const int PAIRS = 16;
+static const int MESSAGES = 20000;
+static const int WINDOW = 1024;
+
+static double run(uint16_t threads) {
+    Loopback loopback(threads);
+    std::vector<SessionPair> pairs;
+    for (int i = 0; i < PAIRS; i++)
+        pairs.push_back(loopback.pair(i));
+
+    auto start = std::chrono::steady_clock::now();
+    loopback.stream(pairs, MESSAGES, WINDOW);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return double(PAIRS) * MESSAGES * FILE_CHUNK_SIZE * 8 / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+    uint16_t maxThreads = argc > 1 ? std::stoi(argv[1]) : std::max(std::thread::hardware_concurrency(), 1u);
+    std::cout << PAIRS << " session pairs, " << MESSAGES << " messages each\n";
+    for (uint16_t threads = 1; threads <= maxThreads; threads *= 2)
+        std::cout << "  " << threads << " io threads: " << std::fixed << std::setprecision(1) << run(threads) << " Mbit/s\n";
+    return 0;
+}
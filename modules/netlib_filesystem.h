@@ -2,6 +2,7 @@
 
 #include "../netlib_header.h"
 #include "netlib_sha1.h"
+#include "netlib_piecepicker.h"
 
 const std::string INFO_FILETYPE = ".info";
 const std::string DATA_FILETYPE = ".data";
@@ -9,6 +10,35 @@ const std::string DATA_FILETYPE = ".data";
 const std::string DATA_PATH = "./Data";
 
 namespace netlib {
+    using InfoHash = std::array<uint8_t, 20>;
+
+    inline uint8_t fromHexDigit(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return 0;
+    }
+
+    inline InfoHash toInfoHash(const std::string &fileId) {
+        InfoHash hash{};
+        for (size_t i = 0; i < hash.size() && 2 * i + 1 < fileId.size(); i++)
+            hash[i] = (fromHexDigit(fileId[2 * i]) << 4) | fromHexDigit(fileId[2 * i + 1]);
+        return hash;
+    }
+
+    inline std::string toFileId(const InfoHash &hash) {
+        std::string letters = "0123456789abcdef";
+        std::string res;
+        for (uint8_t byte: hash) {
+            res += letters[byte >> 4];
+            res += letters[byte & 0xf];
+        }
+        return res;
+    }
+
     class FileSystem {
     public:
         FileSystem(std::string path) {
@@ -40,7 +70,6 @@ namespace netlib {
 
         enum struct PieceState {
             None,
-            Open,
             Have,
         };
 
@@ -48,13 +77,14 @@ namespace netlib {
             PieceState state;
             uint64_t size;
             std::string sha1;
-            uint64_t lastTime = -1;
         };
 
         struct FileInfo {
             std::string fileName;
             std::string fileId;
             std::vector<PieceInfo> pieces;
+            // Which missing piece to fetch next and from whom.
+            PiecePicker picker;
         };
 
         bool checkExists(const std::string &&path) {
@@ -87,12 +117,15 @@ namespace netlib {
 
         void checkPieces(FileInfo &file) {
             std::filesystem::create_directories(DATA_PATH + "\\" + file.fileId);
+            std::vector<bool> have(file.pieces.size());
             for (int i = 0; i < file.pieces.size(); i++) {
                 if (checkPiece(file, i))
                     file.pieces[i].state = PieceState::Have;
                 else
                     file.pieces[i].state = PieceState::None;
+                have[i] = file.pieces[i].state == PieceState::Have;
             }
+            file.picker.reset(have);
         }
 
         void updateFullFile(const std::string &path) {
@@ -120,35 +153,98 @@ namespace netlib {
             return true;
         }
 
-        uint64_t getNonePiece(std::string &fileId) {
-            if (m_filesInfo.find(fileId) != m_filesInfo.end()) {
-                for (int i = 0; i < m_filesInfo[fileId].pieces.size(); i++) {
-                    if (m_filesInfo[fileId].pieces[i].state == PieceState::None) {
-                        m_filesInfo[fileId].pieces[i].state = PieceState::Open;
-                        m_filesInfo[fileId].pieces[i].lastTime = clock();
-                        return i;
-                    }
-                }
-                return -1;
+        bool hasPiece(const std::string &fileId, uint64_t pieceId) {
+            auto it = m_filesInfo.find(fileId);
+            return it != m_filesInfo.end() && pieceId < it->second.pieces.size() &&
+                   it->second.pieces[pieceId].state == PieceState::Have;
+        }
+
+        bool holdsPieces(const std::string &fileId) {
+            auto it = m_filesInfo.find(fileId);
+            if (it == m_filesInfo.end())
+                return false;
+            for (const auto &piece: it->second.pieces) {
+                if (piece.state == PieceState::Have)
+                    return true;
             }
-            return -1;
+            return false;
         }
 
-        void addPiece(std::string &fileId, uint64_t pieceId) {
-            if (m_filesInfo.find(fileId) == m_filesInfo.end())
+        // Known and still incomplete.
+        bool wantsFile(const std::string &fileId) {
+            return m_filesInfo.find(fileId) != m_filesInfo.end() && !checkFile(fileId);
+        }
+
+        size_t pieceCount(const std::string &fileId) {
+            auto it = m_filesInfo.find(fileId);
+            return it == m_filesInfo.end() ? 0 : it->second.pieces.size();
+        }
+
+        std::vector<bool> getBitfield(const std::string &fileId) {
+            std::vector<bool> have(pieceCount(fileId));
+            for (size_t i = 0; i < have.size(); i++)
+                have[i] = m_filesInfo[fileId].pieces[i].state == PieceState::Have;
+            return have;
+        }
+
+        // Next piece to request from peer, -1 if it has nothing we still need.
+        uint64_t pickPiece(const std::string &fileId, uint16_t peer) {
+            auto it = m_filesInfo.find(fileId);
+            if (it == m_filesInfo.end())
+                return -1;
+            return it->second.picker.pick(peer);
+        }
+
+        // Hands a piece the peer was fetching back, the next pickPiece() may give it to someone else.
+        void releasePiece(const std::string &fileId, uint64_t pieceId, uint16_t peer) {
+            auto it = m_filesInfo.find(fileId);
+            if (it != m_filesInfo.end())
+                it->second.picker.release(pieceId, peer);
+        }
+
+        void addPeer(const std::string &fileId, uint16_t peer, const std::vector<bool> &pieces) {
+            auto it = m_filesInfo.find(fileId);
+            if (it == m_filesInfo.end())
                 return;
+            if (std::find(pieces.begin(), pieces.end(), false) == pieces.end())
+                it->second.picker.addSeed(peer);
+            else
+                it->second.picker.addPeer(peer, pieces);
+        }
+
+        void peerHas(const std::string &fileId, uint16_t peer, uint64_t pieceId) {
+            auto it = m_filesInfo.find(fileId);
+            if (it != m_filesInfo.end())
+                it->second.picker.peerHas(peer, pieceId);
+        }
+
+        void removePeer(const std::string &fileId, uint16_t peer) {
+            auto it = m_filesInfo.find(fileId);
+            if (it != m_filesInfo.end())
+                it->second.picker.removePeer(peer);
+        }
+
+        // True if the piece passed its check.
+        bool addPiece(std::string &fileId, uint64_t pieceId) {
+            if (m_filesInfo.find(fileId) == m_filesInfo.end())
+                return false;
             if (m_filesInfo[fileId].pieces.size() <= pieceId)
-                return;
-            if (checkPiece(m_filesInfo[fileId], pieceId))
+                return false;
+            if (checkPiece(m_filesInfo[fileId], pieceId)) {
                 m_filesInfo[fileId].pieces[pieceId].state = PieceState::Have;
-            else
+                m_filesInfo[fileId].picker.complete(pieceId);
+            } else {
                 m_filesInfo[fileId].pieces[pieceId].state = PieceState::None;
+                m_filesInfo[fileId].picker.fail(pieceId);
+                return false;
+            }
 
             for (auto &p: m_filesInfo[fileId].pieces) {
                 if (p.state != PieceState::Have)
-                    return;
+                    return true;
             }
             mergePieces(m_filesInfo[fileId]);
+            return true;
         }
 
         std::string getFileName(std::string &path)
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "../netlib_header.h"
+
+// Most peers one piece is requested from once only pieces already in flight are left.
+const uint16_t ENDGAME_REQUESTS = 3;
+
+namespace netlib {
+
+    // Wire form of a bitfield: a format byte, then either the raw bits or the lengths of the
+    // alternating missing/have runs as varints, starting with missing, whichever is shorter.
+    inline std::vector<uint8_t> encodeBitfield(const std::vector<bool> &pieces) {
+        std::vector<uint8_t> raw{0}, runs{1};
+        raw.resize(1 + (pieces.size() + 7) / 8);
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (pieces[i])
+                raw[1 + i / 8] |= 1 << (i % 8);
+        }
+        bool state = false;
+        for (size_t i = 0; i < pieces.size();) {
+            uint64_t run = 0;
+            while (i < pieces.size() && pieces[i] == state) {
+                run++;
+                i++;
+            }
+            for (; run >= 0x80; run >>= 7)
+                runs.push_back((run & 0x7f) | 0x80);
+            runs.push_back(run);
+            state = !state;
+        }
+        return runs.size() < raw.size() ? runs : raw;
+    }
+
+    inline std::vector<bool> decodeBitfield(const std::vector<uint8_t> &data, size_t count) {
+        std::vector<bool> pieces(count);
+        if (data.empty())
+            return pieces;
+        if (data[0] == 0) {
+            for (size_t i = 0; i < count && 1 + i / 8 < data.size(); i++)
+                pieces[i] = data[1 + i / 8] >> (i % 8) & 1;
+            return pieces;
+        }
+        bool state = false;
+        size_t piece = 0;
+        for (size_t pos = 1; pos < data.size() && piece < count; state = !state) {
+            uint64_t run = 0;
+            for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+                run |= uint64_t(data[pos] & 0x7f) << shift;
+                if (!(data[pos++] & 0x80))
+                    break;
+            }
+            for (; run > 0 && piece < count; run--)
+                pieces[piece++] = state;
+        }
+        return pieces;
+    }
+
+    // Decides which piece to ask a peer for next. Wanted pieces sit in a set ordered by how
+    // many peers have them, rarest first, ties broken by a random rank so that leechers of
+    // one swarm spread over different pieces. Seeds raise every piece equally and are only
+    // counted. A peer with nothing wanted left to give goes into endgame and duplicates the
+    // in-flight pieces it has, the first copy in wins. An open piece only becomes wanted again
+    // through release or fail, the owner decides by progress when a peer has stalled.
+    // Every partial peer keeps its own copy of the wanted set cut down to the pieces it has, so
+    // a pick is logarithmic. A piece changing state or availability updates the copy of every
+    // peer holding it. The endgame scan is linear in the open pieces, which stay bounded by
+    // the pipeline depth times the number of peers.
+    class PiecePicker {
+    public:
+        static constexpr uint64_t NONE = -1;
+
+        void reset(const std::vector<bool> &have) {
+            size_t count = have.size();
+            m_state.assign(count, State::Wanted);
+            m_availability.assign(count, 0);
+            m_requesters.assign(count, {});
+            m_openedAt.assign(count, {});
+            m_rank.resize(count);
+            std::iota(m_rank.begin(), m_rank.end(), 0);
+            std::shuffle(m_rank.begin(), m_rank.end(), std::mt19937(std::random_device()()));
+            m_wanted.clear();
+            m_open.clear();
+            m_peers.clear();
+            m_seeds = 0;
+            for (uint64_t piece = 0; piece < count; piece++) {
+                if (have[piece])
+                    m_state[piece] = State::Have;
+                else
+                    m_wanted.insert(key(piece));
+            }
+        }
+
+        void addSeed(uint16_t peer) {
+            removePeer(peer);
+            m_peers[peer].seed = true;
+            m_seeds++;
+        }
+
+        void addPeer(uint16_t peer, const std::vector<bool> &pieces) {
+            removePeer(peer);
+            m_peers[peer].pieces.assign(m_state.size(), false);
+            for (uint64_t piece = 0; piece < pieces.size() && piece < m_state.size(); piece++) {
+                if (pieces[piece])
+                    peerHas(peer, piece);
+            }
+        }
+
+        void peerHas(uint16_t peer, uint64_t piece) {
+            auto it = m_peers.find(peer);
+            if (it == m_peers.end() || it->second.seed || piece >= m_state.size() || it->second.pieces[piece])
+                return;
+            eraseWanted(piece);
+            it->second.pieces[piece] = true;
+            m_availability[piece]++;
+            insertWanted(piece);
+        }
+
+        void removePeer(uint16_t peer) {
+            auto it = m_peers.find(peer);
+            if (it == m_peers.end())
+                return;
+            if (it->second.seed) {
+                m_seeds--;
+                m_peers.erase(it);
+                return;
+            }
+            std::vector<bool> pieces = std::move(it->second.pieces);
+            m_peers.erase(it);
+            for (uint64_t piece = 0; piece < pieces.size(); piece++) {
+                if (!pieces[piece])
+                    continue;
+                eraseWanted(piece);
+                m_availability[piece]--;
+                insertWanted(piece);
+            }
+        }
+
+        // Number of peers offering the piece.
+        uint16_t availability(uint64_t piece) const {
+            return m_availability[piece] + m_seeds;
+        }
+
+        // Rarest wanted piece the peer has, else an endgame duplicate, else NONE.
+        uint64_t pick(uint16_t peer) {
+            auto peerIt = m_peers.find(peer);
+            if (peerIt == m_peers.end())
+                return NONE;
+            const Peer &from = peerIt->second;
+            const std::set<Key> &wanted = from.seed ? m_wanted : from.wanted;
+            if (!wanted.empty()) {
+                uint64_t piece = std::get<2>(*wanted.begin());
+                eraseWanted(piece);
+                m_state[piece] = State::Open;
+                m_openedAt[piece] = std::chrono::steady_clock::now();
+                m_open.insert({m_openedAt[piece], piece});
+                m_requesters[piece].push_back(peer);
+                return piece;
+            }
+            uint64_t best = NONE;
+            for (auto &[openedAt, piece]: m_open) {
+                std::vector<uint16_t> &requesters = m_requesters[piece];
+                if (requesters.size() >= ENDGAME_REQUESTS || !from.has(piece) ||
+                        std::find(requesters.begin(), requesters.end(), peer) != requesters.end())
+                    continue;
+                if (best == NONE || requesters.size() < m_requesters[best].size())
+                    best = piece;
+            }
+            if (best != NONE)
+                m_requesters[best].push_back(peer);
+            return best;
+        }
+
+        // The peer gave the piece up, it is wanted again once nobody else is fetching it.
+        void release(uint64_t piece, uint16_t peer) {
+            if (piece >= m_state.size() || m_state[piece] != State::Open)
+                return;
+            std::vector<uint16_t> &requesters = m_requesters[piece];
+            requesters.erase(std::remove(requesters.begin(), requesters.end(), peer), requesters.end());
+            if (requesters.empty())
+                unopen(piece);
+        }
+
+        void complete(uint64_t piece) {
+            if (piece >= m_state.size() || m_state[piece] == State::Have)
+                return;
+            if (m_state[piece] == State::Open)
+                m_open.erase({m_openedAt[piece], piece});
+            else
+                eraseWanted(piece);
+            m_state[piece] = State::Have;
+            m_requesters[piece].clear();
+        }
+
+        // The piece failed its check, every copy still in flight is forgotten.
+        void fail(uint64_t piece) {
+            if (piece >= m_state.size() || m_state[piece] != State::Open)
+                return;
+            unopen(piece);
+        }
+
+    private:
+        enum struct State : uint8_t {
+            Wanted,
+            Open,
+            Have,
+        };
+
+        using Key = std::tuple<uint16_t, uint32_t, uint64_t>;
+
+        struct Peer {
+            bool seed = false;
+            std::vector<bool> pieces;
+            // Keys of the wanted pieces this peer has, empty for seeds.
+            std::set<Key> wanted;
+
+            bool has(uint64_t piece) const {
+                return seed || pieces[piece];
+            }
+        };
+
+        Key key(uint64_t piece) const {
+            return {m_availability[piece], m_rank[piece], piece};
+        }
+
+        // Take a wanted piece out of the global set and every peer's copy, before its key changes.
+        void eraseWanted(uint64_t piece) {
+            if (m_state[piece] != State::Wanted)
+                return;
+            Key k = key(piece);
+            m_wanted.erase(k);
+            for (auto &[id, peer]: m_peers) {
+                if (!peer.seed && peer.pieces[piece])
+                    peer.wanted.erase(k);
+            }
+        }
+
+        void insertWanted(uint64_t piece) {
+            if (m_state[piece] != State::Wanted)
+                return;
+            Key k = key(piece);
+            m_wanted.insert(k);
+            for (auto &[id, peer]: m_peers) {
+                if (!peer.seed && peer.pieces[piece])
+                    peer.wanted.insert(k);
+            }
+        }
+
+        void unopen(uint64_t piece) {
+            m_open.erase({m_openedAt[piece], piece});
+            m_requesters[piece].clear();
+            m_state[piece] = State::Wanted;
+            insertWanted(piece);
+        }
+
+        std::vector<State> m_state;
+        std::vector<uint16_t> m_availability;
+        std::vector<uint32_t> m_rank;
+        std::vector<std::vector<uint16_t>> m_requesters;
+        std::vector<std::chrono::steady_clock::time_point> m_openedAt;
+        std::set<Key> m_wanted;
+        std::set<std::pair<std::chrono::steady_clock::time_point, uint64_t>> m_open;
+        std::map<uint16_t, Peer> m_peers;
+        uint16_t m_seeds = 0;
+    };
+}
@@ -2,13 +2,19 @@
 #include "netlib_typesenum.h"
 
 #include "netlib_header.h"
+#include "netlib_bufferpool.h"
 #include "netlib_message.h"
 #include "netlib_safequeue.h"
+#include "netlib_reorderbuffer.h"
+#include "netlib_timerwheel.h"
+#include "netlib_uring.h"
 #include "netlib_session.h"
+#include "netlib_reuseport.h"
 #include "netlib_server.h"
 #include "netlib_natkiller.h"
 #include "modules/netlib_filesystem.h"
 #include "modules/netlib_sha1.h"
+#include "modules/netlib_piecepicker.h"
 
 
 #include "netlib_node.h"
\ No newline at end of file
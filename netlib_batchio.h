@@ -0,0 +1,245 @@
+#pragma once
+
+#include "netlib_header.h"
+
+#if defined(__linux__) && !defined(NETLIB_NO_BATCH_IO)
+#define NETLIB_BATCH_IO
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <cerrno>
+#include <climits>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+uint16_t BATCH_SIZE = 16;
+
+// Gather buffers one send may take: sendmmsg accepts IOV_MAX per message, asio silently sends only the first 64.
+#ifdef NETLIB_BATCH_IO
+constexpr size_t MAX_DATAGRAM_BUFFERS = IOV_MAX;
+#else
+constexpr size_t MAX_DATAGRAM_BUFFERS = 64;
+#endif
+
+// Kernel segmentation (UDP_SEGMENT) and receive coalescing (UDP_GRO) where the socket supports them.
+bool USE_UDP_OFFLOAD = true;
+// Segment limit until the path MTU search confirms a larger one.
+uint32_t MAX_GSO_SEGMENT = 1472;
+uint16_t MAX_GSO_SEGMENTS = 64;
+uint32_t MAX_GSO_BYTES = 65000;
+uint32_t GRO_BUFFER_SIZE = 1 << 16;
+
+namespace netlib {
+
+#ifdef NETLIB_BATCH_IO
+
+    inline bool enableGro(asio::ip::udp::socket &socket) {
+        int on = 1;
+        return ::setsockopt(socket.native_handle(), IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    }
+
+    inline bool supportsGso(asio::ip::udp::socket &socket) {
+        int size = 0;
+        socklen_t length = sizeof(size);
+        return ::getsockopt(socket.native_handle(), IPPROTO_UDP, UDP_SEGMENT, &size, &length) == 0;
+    }
+
+    struct alignas(cmsghdr) ControlBuffer {
+        uint8_t data[CMSG_SPACE(sizeof(int))];
+    };
+
+    // Size of the datagrams a GRO-coalesced read holds, 0 when it holds a single one.
+    inline size_t groSegment(msghdr &header) {
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment;
+                std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                return segment > 0 ? segment : 0;
+            }
+        }
+        return 0;
+    }
+
+    // Fixed ring of receive slots drained with one recvmmsg per readiness wakeup.
+    // A slot filled by GRO holds several equal datagrams and is split again here.
+    class BatchReceiver {
+    public:
+        BatchReceiver(size_t slots, size_t slotSize) : m_slotSize(slotSize), m_data(slots * slotSize),
+                                                       m_iov(slots), m_addrs(slots), m_control(slots), m_headers(slots) {}
+
+        BatchReceiver(const BatchReceiver &) = delete;
+
+        static std::unique_ptr<BatchReceiver> forSocket(asio::ip::udp::socket &socket, size_t datagramSize) {
+            if (USE_UDP_OFFLOAD && enableGro(socket))
+                return std::make_unique<BatchReceiver>(std::max(BATCH_SIZE / 2, 1),
+                                                       std::max<size_t>(datagramSize, GRO_BUFFER_SIZE));
+            return std::make_unique<BatchReceiver>(BATCH_SIZE, datagramSize);
+        }
+
+        // Returns the number of datagrams handed to onDatagram, 0 if none were ready, -1 on socket error.
+        template<typename F>
+        int receive(asio::ip::udp::socket &socket, F &&onDatagram) {
+            for (size_t i = 0; i < m_headers.size(); i++) {
+                m_iov[i].iov_base = m_data.data() + i * m_slotSize;
+                m_iov[i].iov_len = m_slotSize;
+                m_headers[i] = {};
+                m_headers[i].msg_hdr.msg_name = &m_addrs[i];
+                m_headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                m_headers[i].msg_hdr.msg_iov = &m_iov[i];
+                m_headers[i].msg_hdr.msg_iovlen = 1;
+                m_headers[i].msg_hdr.msg_control = m_control[i].data;
+                m_headers[i].msg_hdr.msg_controllen = sizeof(ControlBuffer);
+            }
+            int count = ::recvmmsg(socket.native_handle(), m_headers.data(), m_headers.size(), MSG_DONTWAIT, nullptr);
+            if (count < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            asio::ip::udp::endpoint from;
+            for (int i = 0; i < count; i++) {
+                if (m_headers[i].msg_hdr.msg_flags & MSG_TRUNC)
+                    continue;
+                size_t addrLen = std::min<size_t>(m_headers[i].msg_hdr.msg_namelen, from.capacity());
+                std::memcpy(from.data(), &m_addrs[i], addrLen);
+                from.resize(addrLen);
+                const uint8_t *data = static_cast<const uint8_t *>(m_iov[i].iov_base);
+                size_t length = m_headers[i].msg_len;
+                size_t segment = groSegment(m_headers[i].msg_hdr);
+                if (segment == 0)
+                    segment = length;
+                for (size_t offset = 0; offset < length; offset += segment)
+                    onDatagram(from, data + offset, std::min(segment, length - offset));
+            }
+            return count;
+        }
+
+    private:
+        size_t m_slotSize;
+        std::vector<uint8_t> m_data;
+        std::vector<iovec> m_iov;
+        std::vector<sockaddr_storage> m_addrs;
+        std::vector<ControlBuffer> m_control;
+        std::vector<mmsghdr> m_headers;
+    };
+
+    // Sends datagrams made of gather buffers with one sendmmsg, datagram i is buffers [ends[i-1], ends[i]).
+    // With GSO, runs of equal-sized datagrams go out as one super-datagram the kernel splits.
+    class BatchSender {
+    public:
+        void setGso(bool enabled) {
+            m_gso = enabled;
+        }
+
+        bool hasGso() const {
+            return m_gso;
+        }
+
+        // Largest datagram sent as a GSO segment, the session passes its confirmed path MTU.
+        void setSegmentLimit(size_t limit) {
+            m_segmentLimit = std::max<size_t>(limit, MAX_GSO_SEGMENT);
+        }
+
+        // Returns how many datagrams from first on were sent, 0 if the socket would block, -1 on socket error.
+        int send(asio::ip::udp::socket &socket, const asio::ip::udp::endpoint *to,
+                 const std::vector<asio::const_buffer> &buffers, const std::vector<size_t> &ends, size_t first) {
+            prepare(to, buffers, ends, first);
+            int count = ::sendmmsg(socket.native_handle(), m_headers.data(), m_headers.size(), MSG_DONTWAIT);
+            if (count < 0 && m_gso && (errno == EIO || errno == EINVAL)) {
+                m_gso = false;
+                group(to, ends, first);
+                count = ::sendmmsg(socket.native_handle(), m_headers.data(), m_headers.size(), MSG_DONTWAIT);
+            }
+            if (count < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            int sent = 0;
+            for (int i = 0; i < count; i++)
+                sent += m_groupSizes[i];
+            return sent;
+        }
+
+        // Builds the headers of the datagrams from first on without sending them, valid until the next call.
+        std::vector<mmsghdr> &prepare(const asio::ip::udp::endpoint *to, const std::vector<asio::const_buffer> &buffers,
+                                      const std::vector<size_t> &ends, size_t first) {
+            m_iov.resize(buffers.size());
+            for (size_t i = 0; i < buffers.size(); i++) {
+                m_iov[i].iov_base = const_cast<void *>(buffers[i].data());
+                m_iov[i].iov_len = buffers[i].size();
+            }
+            m_lengths.clear();
+            m_iovCounts.clear();
+            for (size_t i = first; i < ends.size(); i++) {
+                size_t length = 0;
+                for (size_t j = i == 0 ? 0 : ends[i - 1]; j < ends[i]; j++)
+                    length += m_iov[j].iov_len;
+                m_lengths.push_back(length);
+                m_iovCounts.push_back(ends[i] - (i == 0 ? 0 : ends[i - 1]));
+            }
+            group(to, ends, first);
+            return m_headers;
+        }
+
+    private:
+        void group(const asio::ip::udp::endpoint *to, const std::vector<size_t> &ends, size_t first) {
+            m_headers.clear();
+            m_groupSizes.clear();
+            m_control.resize(m_lengths.size());
+            for (size_t i = 0; i < m_lengths.size();) {
+                size_t segments = m_gso ? gsoRun(i) : 1;
+                size_t begin = i + first == 0 ? 0 : ends[i + first - 1];
+                mmsghdr header = {};
+                header.msg_hdr.msg_name = to ? const_cast<sockaddr *>(to->data()) : nullptr;
+                header.msg_hdr.msg_namelen = to ? to->size() : 0;
+                header.msg_hdr.msg_iov = m_iov.data() + begin;
+                header.msg_hdr.msg_iovlen = ends[i + first + segments - 1] - begin;
+                if (segments > 1) {
+                    ControlBuffer &control = m_control[m_headers.size()];
+                    std::memset(control.data, 0, sizeof(control.data));
+                    header.msg_hdr.msg_control = control.data;
+                    header.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                    cmsghdr *cmsg = CMSG_FIRSTHDR(&header.msg_hdr);
+                    cmsg->cmsg_level = IPPROTO_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t segmentSize = m_lengths[i];
+                    std::memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+                }
+                m_headers.push_back(header);
+                m_groupSizes.push_back(segments);
+                i += segments;
+            }
+        }
+
+        // All segments but the last must be exactly the size of the first, the last may be shorter.
+        size_t gsoRun(size_t i) const {
+            size_t segment = m_lengths[i];
+            if (segment > m_segmentLimit)
+                return 1;
+            size_t count = 1, total = segment, iovs = m_iovCounts[i];
+            while (i + count < m_lengths.size() && count < MAX_GSO_SEGMENTS &&
+                    total + m_lengths[i + count] <= MAX_GSO_BYTES && m_lengths[i + count] <= segment &&
+                    iovs + m_iovCounts[i + count] <= MAX_DATAGRAM_BUFFERS) {
+                total += m_lengths[i + count];
+                iovs += m_iovCounts[i + count];
+                count++;
+                if (m_lengths[i + count - 1] < segment)
+                    break;
+            }
+            return count;
+        }
+
+        bool m_gso = false;
+        size_t m_segmentLimit = MAX_GSO_SEGMENT;
+        std::vector<iovec> m_iov;
+        std::vector<size_t> m_lengths;
+        std::vector<size_t> m_iovCounts;
+        std::vector<size_t> m_groupSizes;
+        std::vector<ControlBuffer> m_control;
+        std::vector<mmsghdr> m_headers;
+    };
+
+#endif
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include "netlib_header.h"
+
+namespace netlib {
+
+    // Free blocks by size class. Each thread keeps up to THREAD_CACHE_BLOCKS of a class for
+    // itself and trades half of them with the shared lists when it runs dry or over, so io
+    // threads of different shards only meet on the lock once per batch, not per message.
+    class BufferPool {
+    public:
+        static constexpr std::array<size_t, 4> SIZE_CLASSES = {512, 2048, 8192, 1 << 16};
+        static constexpr size_t MAX_CACHED_BYTES = 1 << 22;
+        static constexpr size_t THREAD_CACHE_BLOCKS = 32;
+
+        BufferPool(const BufferPool &) = delete;
+
+        ~BufferPool() {
+            for (auto &freeList: m_freeLists) {
+                for (uint8_t *block: freeList)
+                    delete[] block;
+            }
+        }
+
+        static BufferPool &global() {
+            static BufferPool *pool = new BufferPool();
+            return *pool;
+        }
+
+        static size_t classCapacity(size_t size) {
+            for (size_t capacity: SIZE_CLASSES) {
+                if (size <= capacity)
+                    return capacity;
+            }
+            return size;
+        }
+
+        uint8_t *acquire(size_t capacity) {
+            int sizeClass = classIndex(capacity);
+            if (sizeClass != -1) {
+                ThreadCache &cache = threadCache();
+                std::vector<uint8_t *> &local = cache.freeLists[sizeClass];
+                if (local.empty())
+                    refill(sizeClass, local);
+                if (!local.empty()) {
+                    uint8_t *block = local.back();
+                    local.pop_back();
+                    cache.hits.store(cache.hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return block;
+                }
+            }
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return new uint8_t[capacity];
+        }
+
+        void release(uint8_t *block, size_t capacity) {
+            int sizeClass = classIndex(capacity);
+            if (sizeClass == -1) {
+                delete[] block;
+                return;
+            }
+            std::vector<uint8_t *> &local = threadCache().freeLists[sizeClass];
+            local.push_back(block);
+            if (local.size() > THREAD_CACHE_BLOCKS)
+                spill(sizeClass, local, THREAD_CACHE_BLOCKS / 2);
+        }
+
+        // Acquisitions served by a pooled block, against getMisses() for the ones that allocated.
+        uint64_t getHits() const {
+            std::scoped_lock lock(m_mutex);
+            uint64_t hits = m_retiredHits;
+            for (const ThreadCache *cache: m_caches)
+                hits += cache->hits.load(std::memory_order_relaxed);
+            return hits;
+        }
+
+        uint64_t getMisses() const {
+            return m_misses;
+        }
+
+    private:
+        // Only global() makes one, thread caches rely on it never going away.
+        BufferPool() = default;
+
+        using FreeLists = std::array<std::vector<uint8_t *>, SIZE_CLASSES.size()>;
+
+        // Returns its blocks to the pool when the thread exits. Hits are only written by the owning
+        // thread, so counting them costs no shared cache line.
+        struct ThreadCache {
+            explicit ThreadCache(BufferPool *pool) : pool(pool) {
+                std::scoped_lock lock(pool->m_mutex);
+                pool->m_caches.push_back(this);
+            }
+
+            ~ThreadCache() {
+                for (size_t i = 0; i < freeLists.size(); i++)
+                    pool->spill(i, freeLists[i], 0);
+                std::scoped_lock lock(pool->m_mutex);
+                pool->m_retiredHits += hits.load(std::memory_order_relaxed);
+                std::erase(pool->m_caches, this);
+            }
+
+            BufferPool *pool;
+            FreeLists freeLists;
+            std::atomic<uint64_t> hits = 0;
+        };
+
+        static int classIndex(size_t capacity) {
+            for (size_t i = 0; i < SIZE_CLASSES.size(); i++) {
+                if (SIZE_CLASSES[i] == capacity)
+                    return (int)i;
+            }
+            return -1;
+        }
+
+        ThreadCache &threadCache() {
+            thread_local ThreadCache cache(this);
+            return cache;
+        }
+
+        void refill(size_t sizeClass, std::vector<uint8_t *> &local) {
+            std::scoped_lock lock(m_mutex);
+            std::vector<uint8_t *> &shared = m_freeLists[sizeClass];
+            size_t count = std::min(shared.size(), THREAD_CACHE_BLOCKS / 2);
+            local.insert(local.end(), shared.end() - count, shared.end());
+            shared.resize(shared.size() - count);
+        }
+
+        // Moves all but keep blocks to the shared list, what it cannot cache is freed.
+        void spill(size_t sizeClass, std::vector<uint8_t *> &local, size_t keep) {
+            std::scoped_lock lock(m_mutex);
+            std::vector<uint8_t *> &shared = m_freeLists[sizeClass];
+            while (local.size() > keep) {
+                if (shared.size() * SIZE_CLASSES[sizeClass] < MAX_CACHED_BYTES)
+                    shared.push_back(local.back());
+                else
+                    delete[] local.back();
+                local.pop_back();
+            }
+        }
+
+        mutable std::mutex m_mutex;
+        FreeLists m_freeLists;
+        std::vector<ThreadCache *> m_caches;
+        uint64_t m_retiredHits = 0;
+        std::atomic<uint64_t> m_misses = 0;
+    };
+
+    template<typename U>
+    struct PoolAllocator {
+        using value_type = U;
+
+        PoolAllocator() = default;
+
+        template<typename V>
+        PoolAllocator(const PoolAllocator<V> &) {}
+
+        U *allocate(size_t n) {
+            return reinterpret_cast<U *>(BufferPool::global().acquire(BufferPool::classCapacity(n * sizeof(U))));
+        }
+
+        void deallocate(U *ptr, size_t n) {
+            BufferPool::global().release(reinterpret_cast<uint8_t *>(ptr), BufferPool::classCapacity(n * sizeof(U)));
+        }
+
+        template<typename V>
+        bool operator == (const PoolAllocator<V> &) const {
+            return true;
+        }
+    };
+
+    class MessageBuffer {
+    public:
+        static constexpr size_t INLINE_SIZE = 48;
+
+        MessageBuffer() = default;
+
+        explicit MessageBuffer(BufferPool &pool) : m_pool(&pool) {}
+
+        MessageBuffer(const MessageBuffer &other) : m_pool(other.m_pool) {
+            assign(other.data(), other.data() + other.size());
+        }
+
+        MessageBuffer(MessageBuffer &&other) noexcept : m_pool(other.m_pool) {
+            steal(other);
+        }
+
+        ~MessageBuffer() {
+            freeHeap();
+        }
+
+        MessageBuffer &operator = (const MessageBuffer &other) {
+            if (this != &other)
+                assign(other.data(), other.data() + other.size());
+            return *this;
+        }
+
+        MessageBuffer &operator = (MessageBuffer &&other) noexcept {
+            if (this != &other) {
+                freeHeap();
+                m_pool = other.m_pool;
+                steal(other);
+            }
+            return *this;
+        }
+
+        uint8_t *data() {
+            return m_heap ? m_heap : m_inline.data();
+        }
+
+        const uint8_t *data() const {
+            return m_heap ? m_heap : m_inline.data();
+        }
+
+        uint8_t &operator [] (size_t pos) {
+            return data()[pos];
+        }
+
+        const uint8_t &operator [] (size_t pos) const {
+            return data()[pos];
+        }
+
+        uint8_t *begin() {
+            return data();
+        }
+
+        uint8_t *end() {
+            return data() + m_size;
+        }
+
+        const uint8_t *begin() const {
+            return data();
+        }
+
+        const uint8_t *end() const {
+            return data() + m_size;
+        }
+
+        size_t size() const {
+            return m_size;
+        }
+
+        size_t capacity() const {
+            return m_capacity;
+        }
+
+        bool empty() const {
+            return m_size == 0;
+        }
+
+        void clear() {
+            m_size = 0;
+        }
+
+        void reserve(size_t capacity) {
+            if (capacity <= m_capacity)
+                return;
+            size_t newCapacity = BufferPool::classCapacity(std::max(capacity, m_capacity * 2));
+            uint8_t *block = m_pool->acquire(newCapacity);
+            if (m_size > 0)
+                std::memcpy(block, data(), m_size);
+            freeHeap();
+            m_heap = block;
+            m_capacity = newCapacity;
+        }
+
+        // Grown bytes are left uninitialized, callers always overwrite them.
+        void resize(size_t size) {
+            reserve(size);
+            m_size = size;
+        }
+
+        void assign(const uint8_t *first, const uint8_t *last) {
+            m_size = 0;
+            resize(last - first);
+            if (m_size > 0)
+                std::memcpy(data(), first, m_size);
+        }
+
+        friend bool operator == (const MessageBuffer &a, const MessageBuffer &b) {
+            return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+        }
+
+    private:
+        void freeHeap() {
+            if (m_heap)
+                m_pool->release(m_heap, m_capacity);
+            m_heap = nullptr;
+            m_capacity = INLINE_SIZE;
+        }
+
+        void steal(MessageBuffer &other) {
+            m_size = other.m_size;
+            if (other.m_heap) {
+                m_heap = other.m_heap;
+                m_capacity = other.m_capacity;
+                other.m_heap = nullptr;
+                other.m_capacity = INLINE_SIZE;
+            } else {
+                m_heap = nullptr;
+                m_capacity = INLINE_SIZE;
+                std::memcpy(m_inline.data(), other.m_inline.data(), m_size);
+            }
+            other.m_size = 0;
+        }
+
+        BufferPool *m_pool = &BufferPool::global();
+        uint8_t *m_heap = nullptr;
+        size_t m_size = 0;
+        size_t m_capacity = INLINE_SIZE;
+        std::array<uint8_t, INLINE_SIZE> m_inline;
+    };
+}
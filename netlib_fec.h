@@ -0,0 +1,143 @@
+#pragma once
+
+#include "netlib_header.h"
+
+bool USE_FEC = true;
+uint16_t FEC_GROUP_SIZE = 16;
+uint16_t FEC_MAX_PARITY = 4;
+double FEC_MIN_LOSS = 0.01;
+uint16_t FEC_CACHE_SIZE = 512;
+
+namespace netlib {
+
+    // Interleaved XOR parity over a group of frames: parity j covers frames
+    // first + j, first + j + stride, ... so up to stride losses in a row are recoverable.
+    class FecEncoder {
+    public:
+        // xorLength, firstId, count, stride and class after the parity bytes.
+        static constexpr size_t TRAILER_SIZE = sizeof(uint32_t) + sizeof(uint64_t) + 3 * sizeof(uint16_t);
+
+        void begin(uint64_t firstId, uint16_t stride) {
+            m_firstId = firstId;
+            m_count = 0;
+            m_stride = std::max<uint16_t>(stride, 1);
+            m_parity.resize(m_stride);
+            m_lengths.assign(m_stride, 0);
+            for (auto &parity: m_parity)
+                parity.clear();
+        }
+
+        bool active() const {
+            return m_count > 0;
+        }
+
+        uint64_t firstId() const {
+            return m_firstId;
+        }
+
+        uint16_t count() const {
+            return m_count;
+        }
+
+        uint16_t stride() const {
+            return m_stride;
+        }
+
+        // Frames are added in id order, each as the list of buffers it is sent as.
+        void add(const std::vector<asio::const_buffer> &frame) {
+            size_t cls = m_count % m_stride;
+            std::vector<uint8_t> &parity = m_parity[cls];
+            size_t pos = 0;
+            for (const asio::const_buffer &buffer: frame) {
+                const uint8_t *bytes = static_cast<const uint8_t *>(buffer.data());
+                if (parity.size() < pos + buffer.size())
+                    parity.resize(pos + buffer.size(), 0);
+                for (size_t i = 0; i < buffer.size(); i++)
+                    parity[pos + i] ^= bytes[i];
+                pos += buffer.size();
+            }
+            m_lengths[cls] ^= pos;
+            m_count++;
+        }
+
+        const std::vector<uint8_t> &parity(size_t cls) const {
+            return m_parity[cls];
+        }
+
+        uint32_t xorLength(size_t cls) const {
+            return m_lengths[cls];
+        }
+
+    private:
+        uint64_t m_firstId = 0;
+        uint16_t m_count = 0;
+        uint16_t m_stride = 1;
+        std::vector<std::vector<uint8_t>> m_parity;
+        std::vector<uint32_t> m_lengths;
+    };
+
+    // Raw bytes of recently received reliable frames, kept so parity can rebuild a missing one.
+    class FecCache {
+    public:
+        explicit FecCache(size_t size) : m_ids(std::max<size_t>(size, 1), 0), m_frames(m_ids.size()) {}
+
+        void store(uint64_t id, const uint8_t *data, size_t length) {
+            size_t slot = id % m_ids.size();
+            m_ids[slot] = id;
+            m_frames[slot].assign(data, data + length);
+        }
+
+        const std::vector<uint8_t> *find(uint64_t id) const {
+            size_t slot = id % m_ids.size();
+            return m_ids[slot] == id ? &m_frames[slot] : nullptr;
+        }
+
+        // XORs the other frames of the class out of parity, returns false if any of them is missing.
+        bool recover(const std::vector<uint64_t> &others, std::vector<uint8_t> &parity, uint32_t xorLength) const {
+            for (uint64_t id: others) {
+                const std::vector<uint8_t> *frame = find(id);
+                if (!frame)
+                    return false;
+                if (parity.size() < frame->size())
+                    parity.resize(frame->size(), 0);
+                for (size_t i = 0; i < frame->size(); i++)
+                    parity[i] ^= (*frame)[i];
+                xorLength ^= frame->size();
+            }
+            if (xorLength > parity.size())
+                return false;
+            parity.resize(xorLength);
+            return true;
+        }
+
+    private:
+        std::vector<uint64_t> m_ids;
+        std::vector<std::vector<uint8_t>> m_frames;
+    };
+
+    // EWMA of the fraction of reliable frames the peer did not get first time.
+    class LossEstimator {
+    public:
+        void onSample(uint64_t sent, uint64_t lost) {
+            if (sent == 0)
+                return;
+            double sample = std::min(1.0, (double)lost / sent);
+            m_loss = m_loss * 0.75 + sample * 0.25;
+        }
+
+        double loss() const {
+            return m_loss;
+        }
+
+        // Parity frames per group: twice the expected losses, none on a clean path.
+        uint16_t parityCount(uint16_t groupSize) const {
+            if (m_loss < FEC_MIN_LOSS)
+                return 0;
+            double expected = m_loss * groupSize * 2;
+            return std::clamp<uint16_t>((uint16_t)std::ceil(expected), 1, FEC_MAX_PARITY);
+        }
+
+    private:
+        double m_loss = 0;
+    };
+}
@@ -3,6 +3,7 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <deque>
 #include <vector>
 #include <algorithm>
@@ -10,10 +11,22 @@
 #include <memory>
 #include <optional>
 #include <map>
+#include <set>
 #include <chrono>
 #include <cstdint>
 #include <fstream>
 #include <random>
+#include <array>
+#include <atomic>
+#include <span>
+#include <cstring>
+#include <cmath>
+#include <bit>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <numeric>
+#include <tuple>
 #define ASIO_STANDALONE
 #include <asio.hpp>
 #include <asio/ts/buffer.hpp>
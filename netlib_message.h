@@ -1,8 +1,12 @@
 #pragma once
 
 #include "netlib_header.h"
+#include "netlib_bufferpool.h"
 
 namespace netlib {
+    template<typename D>
+    concept BulkSerializable = std::is_trivially_copyable_v<D> && !std::is_same_v<D, bool>;
+
     template<typename T>
     struct MessageHeader {
         T id{};
@@ -12,7 +16,9 @@ namespace netlib {
     template<typename T>
     struct Message {
         MessageHeader<T> m_header;
-        std::vector<uint8_t> m_body;
+        MessageBuffer m_body;
+        // Set when an operator below ran past the body or threw, it prints and returns msg as is.
+        bool m_failed = false;
 
         Message() = default;
 
@@ -28,9 +34,14 @@ namespace netlib {
             return m_header.size;
         }
 
+        bool ok() const {
+            return !m_failed;
+        }
+
         void clear() {
             m_header.size = 0;
             m_body.clear();
+            m_failed = false;
         }
 
         bool empty() {
@@ -42,55 +53,115 @@ namespace netlib {
             return os;
         }
 
+        template<typename D> requires std::is_trivially_copyable_v<D>
+        void writeBytes(std::span<const D> data) {
+            size_t prevSz = m_body.size();
+            m_body.resize(prevSz + data.size_bytes());
+            if (!data.empty())
+                std::memcpy(m_body.data() + prevSz, data.data(), data.size_bytes());
+            m_header.size = m_body.size();
+        }
+
+        template<typename D> requires std::is_trivially_copyable_v<D>
+        void readBytes(std::span<D> data) {
+            if (m_body.size() < data.size_bytes())
+                throw std::out_of_range("message body is too short");
+            size_t newSz = m_body.size() - data.size_bytes();
+            if (!data.empty())
+                std::memcpy(data.data(), m_body.data() + newSz, data.size_bytes());
+            m_body.resize(newSz);
+            m_header.size = m_body.size();
+        }
+
+        void writeVarint(uint64_t value) {
+            std::array<uint8_t, 10> bytes;
+            size_t cnt = 0;
+            bytes[cnt++] = value & 0x7f;
+            value >>= 7;
+            while (value > 0) {
+                bytes[cnt++] = (value & 0x7f) | 0x80;
+                value >>= 7;
+            }
+            writeBytes(std::span<const uint8_t>(bytes.data(), cnt));
+        }
+
+        uint64_t readVarint() {
+            uint64_t value = 0;
+            for (int i = 0; i < 10; i++) {
+                uint8_t byte;
+                readBytes(std::span<uint8_t>(&byte, 1));
+                value = (value << 7) | (byte & 0x7f);
+                if (!(byte & 0x80))
+                    return value;
+            }
+            throw std::out_of_range("malformed varint");
+        }
+
         friend netlib::Message<T>& operator << (netlib::Message<T>& msg, const std::string& data) {
             try {
-                std::vector<char> vec;
-                for (char c: data)
-                    vec.push_back(c);
-                msg << vec;
+                msg.m_body.reserve(msg.m_body.size() + data.size() + 10);
+                msg.writeBytes(std::span<const char>(data.data(), data.size()));
+                msg.writeVarint(data.size());
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
             }
         }
 
         friend netlib::Message<T>& operator >> (netlib::Message<T>& msg, std::string& data) {
             try {
-                std::vector<char> vec;
-                msg >> vec;
-                data.clear();
-                for (char c: vec)
-                    data.push_back(c);
+                uint64_t sz = msg.readVarint();
+                if (sz > msg.m_body.size())
+                    throw std::out_of_range("message body is too short");
+                data.resize(sz);
+                msg.readBytes(std::span<char>(data.data(), data.size()));
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
             }
         }
 
         template<typename D>
         friend netlib::Message<T>& operator << (netlib::Message<T>& msg, const std::vector<D>& data) {
             try {
-                uint32_t sz = data.size();
-                for (const D& item: data)
-                    msg << item;
-                msg << sz;
+                if constexpr (BulkSerializable<D>) {
+                    msg.m_body.reserve(msg.m_body.size() + data.size() * sizeof(D) + 10);
+                    msg.writeBytes(std::span<const D>(data));
+                } else {
+                    for (const D& item: data)
+                        msg << item;
+                }
+                msg.writeVarint(data.size());
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
             }
         }
 
         template<typename D>
         friend netlib::Message<T>& operator >> (netlib::Message<T>& msg, std::vector<D>& data) {
             try {
-                uint32_t sz;
-                msg >> sz;
+                uint64_t sz = msg.readVarint();
+                if (sz > msg.m_body.size())
+                    throw std::out_of_range("message body is too short");
                 data.resize(sz);
-                for (uint32_t i = 0; i < sz; i++)
-                    msg >> data[sz - i - 1];
+                if constexpr (BulkSerializable<D>) {
+                    msg.readBytes(std::span<D>(data));
+                } else {
+                    for (uint64_t i = 0; i < sz; i++)
+                        msg >> data[sz - i - 1];
+                }
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
             }
         }
 
@@ -104,12 +175,16 @@ namespace netlib {
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
             }
         }
 
         template<typename D>
         friend netlib::Message<T>& operator >> (netlib::Message<T>& msg, D& data) {
             try {
+                if (msg.m_body.size() < sizeof(D))
+                    throw std::out_of_range("message body is too short");
                 size_t newSz = msg.m_body.size() - sizeof(D);
                 std::memcpy(&data, msg.m_body.data() + newSz, sizeof(D));
                 msg.m_body.resize(newSz);
@@ -117,10 +192,105 @@ namespace netlib {
                 return msg;
             } catch (std::exception &exception) {
                 std::cout << exception.what() << "::: " << (uint16_t )msg.m_header.id << "\n";
+                msg.m_failed = true;
+                return msg;
+            }
+        }
+    };
+
+    template<typename T>
+    class MessageView {
+    public:
+        explicit MessageView(const Message<T> &msg) :
+                m_header(msg.m_header), m_body(msg.m_body.data(), msg.m_body.size()) {
+            m_pos = m_body.size();
+        }
+
+        T getId() const {
+            return m_header.id;
+        }
+
+        size_t remaining() const {
+            return m_pos;
+        }
+
+        bool ok() const {
+            return !m_failed;
+        }
+
+        template<typename D> requires std::is_trivially_copyable_v<D>
+        void readBytes(std::span<D> data) {
+            if (m_failed || m_pos < data.size_bytes()) {
+                m_failed = true;
+                return;
+            }
+            m_pos -= data.size_bytes();
+            if (!data.empty())
+                std::memcpy(data.data(), m_body.data() + m_pos, data.size_bytes());
+        }
+
+        uint64_t readVarint() {
+            uint64_t value = 0;
+            for (int i = 0; i < 10 && !m_failed; i++) {
+                uint8_t byte = 0;
+                readBytes(std::span<uint8_t>(&byte, 1));
+                value = (value << 7) | (byte & 0x7f);
+                if (!(byte & 0x80))
+                    return value;
+            }
+            m_failed = true;
+            return 0;
+        }
+
+        MessageView<T>& operator >> (std::string& data) {
+            uint64_t sz = readVarint();
+            if (m_failed || m_pos < sz) {
+                m_failed = true;
+                return *this;
             }
+            data.resize(sz);
+            readBytes(std::span<char>(data.data(), data.size()));
+            return *this;
         }
+
+        template<typename D>
+        MessageView<T>& operator >> (std::vector<D>& data) {
+            uint64_t sz = readVarint();
+            if (m_failed || m_pos < sz || (BulkSerializable<D> && m_pos < sz * sizeof(D))) {
+                m_failed = true;
+                return *this;
+            }
+            data.resize(sz);
+            if constexpr (BulkSerializable<D>) {
+                readBytes(std::span<D>(data));
+            } else {
+                for (uint64_t i = 0; i < sz; i++)
+                    *this >> data[sz - i - 1];
+            }
+            return *this;
+        }
+
+        template<typename D> requires std::is_trivially_copyable_v<D>
+        MessageView<T>& operator >> (D& data) {
+            readBytes(std::span<D>(&data, 1));
+            return *this;
+        }
+
+    private:
+        MessageHeader<T> m_header;
+        std::span<const uint8_t> m_body;
+        size_t m_pos;
+        bool m_failed = false;
     };
 
+    template<typename T>
+    using SharedPayload = std::shared_ptr<const Message<T>>;
+
+    template<typename T>
+    SharedPayload<T> makePayload(Message<T> &&msg) {
+        return std::allocate_shared<Message<T>>(PoolAllocator<Message<T>>(), std::move(msg));
+    }
+
     template<typename T>
     class Session;
 
@@ -129,7 +299,7 @@ namespace netlib {
         Message<T> msg_;
         std::shared_ptr<Session<T>> session_;
 
-        OwnedMessage(std::shared_ptr<Session<T>> session, Message<T> msg) : msg_(msg), session_(session){
+        OwnedMessage(std::shared_ptr<Session<T>> session, Message<T> msg) : msg_(std::move(msg)), session_(std::move(session)){
 
         }
     };
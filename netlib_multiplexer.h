@@ -0,0 +1,236 @@
+#pragma once
+
+#include "netlib_header.h"
+#include "netlib_session.h"
+#include "netlib_natkiller.h"
+#include "netlib_reuseport.h"
+
+namespace netlib {
+
+    // One bound socket shared by all sessions of a Server. Datagrams carry a
+    // ChannelHeader; dstId picks the session directly, dstId == 0 means the
+    // peer has not heard from us yet and the session is found by address.
+    template<typename T>
+    class Multiplexer {
+    public:
+        // Shards of one Server each bind their own socket to the same port with reusePort.
+        Multiplexer(asio::io_context *context, const asio::ip::udp::endpoint &localEndpoint, std::shared_ptr<TimerWheel> timers,
+                    bool reusePort = false) :
+                m_socket(*context, asio::ip::udp::v4()), m_strand(asio::make_strand(*context)),
+                m_stun(STUN_HOST, STUN_PORT, context, m_socket, std::move(timers), m_strand) {
+            if (reusePort && !enableReusePort(m_socket))
+                throw std::runtime_error("SO_REUSEPORT is not available");
+            m_socket.bind(localEndpoint);
+            setBufferSizes(m_socket);
+#ifdef NETLIB_BATCH_IO
+            m_batchIn = BatchReceiver::forSocket(m_socket, sizeof(ChannelHeader) + sizeof(MessageHeader<T>) + MAX_PACKET_SIZE);
+#endif
+#ifdef NETLIB_IO_URING
+            if (USE_IO_URING)
+                m_ring = UringLoop::create(m_strand);
+#endif
+#ifndef NETLIB_BATCH_IO
+            m_readBuffer.resize(sizeof(ChannelHeader) + sizeof(MessageHeader<T>) + MAX_PACKET_SIZE);
+#endif
+        }
+
+        Multiplexer(const Multiplexer &) = delete;
+
+        // Only the primary socket of a port talks to STUN, the others hand answers over to it.
+        void start(bool primary = true) {
+            m_primary = primary;
+            if (primary) {
+                m_stun.start();
+                m_stun.setPassive();
+            }
+            readDatagram();
+        }
+
+        using MissHandler = std::function<void(const asio::ip::udp::endpoint &, std::vector<uint8_t> &&, size_t)>;
+
+        // Gets datagrams no channel here claims, with the number of shards they already passed.
+        void setMissHandler(MissHandler handler) {
+            asio::post(m_strand, [this, handler = std::move(handler)] () mutable { m_onMiss = std::move(handler); });
+        }
+
+        // Entry point for a datagram handed over by another shard, must run on strand().
+        void deliver(const asio::ip::udp::endpoint &from, const std::vector<uint8_t> &datagram, size_t hops) {
+            dispatch(from, datagram.data(), datagram.size(), hops);
+        }
+
+        void attach(uint16_t id, std::weak_ptr<Session<T>> session, const asio::ip::udp::endpoint &remoteEp) {
+            std::scoped_lock lock(m_mutex);
+            eraseChannel(id);
+            m_channels[id] = {std::move(session), remoteEp.address(), 0};
+            m_byAddress.insert({remoteEp.address(), id});
+        }
+
+        void detach(uint16_t id) {
+            std::scoped_lock lock(m_mutex);
+            eraseChannel(id);
+        }
+
+        asio::ip::udp::socket &socket() {
+            return m_socket;
+        }
+
+        // Owns the socket: reads, STUN and every session's sends on it run here.
+        const asio::strand<asio::io_context::executor_type> &strand() const {
+            return m_strand;
+        }
+
+        asio::ip::udp::endpoint getRealEp() {
+            return m_stun.getEndpoint();
+        }
+
+#ifdef NETLIB_IO_URING
+        // Set when reads and sends of this socket go through io_uring, used on strand() only.
+        UringLoop *ring() {
+            return m_ring.get();
+        }
+#endif
+
+        size_t getChannelsCount() {
+            std::scoped_lock lock(m_mutex);
+            return m_channels.size();
+        }
+
+    private:
+        struct Channel {
+            std::weak_ptr<Session<T>> session;
+            asio::ip::address address;
+            uint16_t remoteId = 0;
+        };
+
+        void eraseChannel(uint16_t id) {
+            auto it = m_channels.find(id);
+            if (it == m_channels.end())
+                return;
+            auto range = m_byAddress.equal_range(it->second.address);
+            for (auto addrIt = range.first; addrIt != range.second; addrIt++) {
+                if (addrIt->second == id) {
+                    m_byAddress.erase(addrIt);
+                    break;
+                }
+            }
+            m_channels.erase(it);
+        }
+
+        std::shared_ptr<Session<T>> findSession(const ChannelHeader &channel, const asio::ip::udp::endpoint &from) {
+            std::scoped_lock lock(m_mutex);
+            if (channel.dstId != 0) {
+                auto it = m_channels.find(channel.dstId);
+                if (it == m_channels.end())
+                    return nullptr;
+                it->second.remoteId = channel.srcId;
+                return it->second.session.lock();
+            }
+            Channel *unbound = nullptr;
+            auto range = m_byAddress.equal_range(from.address());
+            for (auto it = range.first; it != range.second; it++) {
+                Channel &candidate = m_channels[it->second];
+                if (candidate.remoteId == channel.srcId)
+                    return candidate.session.lock();
+                if (candidate.remoteId == 0 && !unbound)
+                    unbound = &candidate;
+            }
+            if (!unbound)
+                return nullptr;
+            unbound->remoteId = channel.srcId;
+            return unbound->session.lock();
+        }
+
+        void miss(const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length, size_t hops) {
+            if (m_onMiss)
+                m_onMiss(from, std::vector<uint8_t>(data, data + length), hops);
+        }
+
+        void dispatch(const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length, size_t hops = 0) {
+            if (m_stun.isServer(from)) {
+                if (m_primary)
+                    m_stun.handleAnswer(from, data, length);
+                else
+                    miss(from, data, length, hops);
+                return;
+            }
+            if (length < sizeof(ChannelHeader))
+                return;
+            ChannelHeader channel;
+            std::memcpy(&channel, data, sizeof(ChannelHeader));
+            std::shared_ptr<Session<T>> session = findSession(channel, from);
+            if (!session) {
+                miss(from, data, length, hops);
+                return;
+            }
+            // The read buffer is reused right away, the session gets its own copy on its strand.
+            asio::post(session->strand(), [session, from, remoteId = channel.srcId,
+                                           datagram = std::vector<uint8_t>(data + sizeof(ChannelHeader), data + length)] () {
+                session->receiveShared(from, remoteId, datagram.data(), datagram.size());
+            });
+        }
+
+        void readDatagram() {
+#ifdef NETLIB_IO_URING
+            if (m_ring) {
+                asio::dispatch(m_strand, [this] () {
+                    size_t datagramSize = sizeof(ChannelHeader) + sizeof(MessageHeader<T>) + MAX_PACKET_SIZE;
+                    if (USE_UDP_OFFLOAD)
+                        datagramSize = std::max<size_t>(datagramSize, GRO_BUFFER_SIZE);
+                    bool armed = m_ring->receive(m_socket.native_handle(), datagramSize,
+                            [this] (const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length) {
+                                dispatch(from, data, length);
+                            });
+                    if (armed)
+                        return;
+                    m_ring.reset();
+                    readDatagram();
+                });
+                return;
+            }
+#endif
+#ifdef NETLIB_BATCH_IO
+            m_socket.async_wait(asio::ip::udp::socket::wait_read, asio::bind_executor(m_strand,
+                                [this] (std::error_code er) {
+                                    if (er == asio::error::operation_aborted || !m_socket.is_open())
+                                        return;
+                                    if (!er)
+                                        m_batchIn->receive(m_socket,
+                                                [this] (const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length) {
+                                                    dispatch(from, data, length);
+                                                });
+                                    readDatagram();
+                                }
+            ));
+#else
+            m_socket.async_receive_from(asio::buffer(m_readBuffer.data(), m_readBuffer.size()), m_from, asio::bind_executor(m_strand,
+                                        [this] (std::error_code er, size_t length) {
+                                            if (er == asio::error::operation_aborted || !m_socket.is_open())
+                                                return;
+                                            if (!er)
+                                                dispatch(m_from, m_readBuffer.data(), length);
+                                            readDatagram();
+                                        }
+            ));
+#endif
+        }
+
+        asio::ip::udp::socket m_socket;
+        asio::strand<asio::io_context::executor_type> m_strand;
+        StunSession m_stun;
+        std::vector<uint8_t> m_readBuffer;
+#ifdef NETLIB_BATCH_IO
+        std::unique_ptr<BatchReceiver> m_batchIn;
+#endif
+#ifdef NETLIB_IO_URING
+        std::unique_ptr<UringLoop> m_ring;
+#endif
+        asio::ip::udp::endpoint m_from;
+
+        bool m_primary = true;
+        MissHandler m_onMiss;
+
+        std::mutex m_mutex;
+        std::map<uint16_t, Channel> m_channels;
+        std::multimap<asio::ip::address, uint16_t> m_byAddress;
+    };
+}
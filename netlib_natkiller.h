@@ -1,13 +1,18 @@
 #pragma once
 #include "netlib_header.h"
-#include "netlib_server.h"
+#include "netlib_timerwheel.h"
 
 namespace netlib {
 
     class StunSession {
     public:
-        StunSession(std::string &stun_host, uint16_t port, asio::io_context *context, asio::ip::udp::socket &sock):
-                socket_(sock), context_(context), timer(*context) {
+        // Bytes 4..7 of the request, every answer echoes them back.
+        static constexpr uint32_t TRANSACTION_WORD = 0x1EB45192;
+
+        // Handlers run on executor, the strand of whoever owns the socket.
+        StunSession(std::string &stun_host, uint16_t port, asio::io_context *context, asio::ip::udp::socket &sock,
+                    std::shared_ptr<TimerWheel> timers, asio::any_io_executor executor):
+                timer(std::move(timers), executor), socket_(sock), context_(context), executor_(std::move(executor)) {
             asio::ip::udp::resolver resolver(*context_);
             asio::ip::udp::resolver::query query(stun_host, std::to_string(port));
             asio::ip::udp::resolver::iterator iter = resolver.resolve(query);
@@ -20,15 +25,17 @@ namespace netlib {
         void sendRequest() {
             if (!isRunning)
                 return;
-            socket_.async_send_to(asio::buffer(reqString_.data(), reqString_.size()), ep_,
+            socket_.async_send_to(asio::buffer(reqString_.data(), reqString_.size()), ep_, asio::bind_executor(executor_,
                                   [this] (std::error_code er, size_t length) {
                                       if (!er) {
-                                          if (isRunning)
+                                          if (isRunning && isPassive)
+                                              scheduleRequest();
+                                          else if (isRunning)
                                               getAnswer();
                                       } else {
                                           std::cerr << "STUN sending error: " << er.message() << "\n";
                                       }
-                                  });
+                                  }));
         }
 
         std::string getIpFromBytes() {
@@ -49,7 +56,7 @@ namespace netlib {
         }
 
         void getAnswer() {
-            socket_.async_receive_from(asio::buffer(ansString_), tempEp_,
+            socket_.async_receive_from(asio::buffer(ansString_), tempEp_, asio::bind_executor(executor_,
                                        [this](std::error_code er, size_t length) {
                                            if (!er) {
                                                if (!isRunning)
@@ -57,27 +64,42 @@ namespace netlib {
                                                if (tempEp_ == ep_) {
                                                    std::string realHost = getIpFromBytes();
                                                    uint32_t realPort = getPortFromBytes();
-                                                   realEp_ = asio::ip::udp::endpoint(
-                                                           asio::ip::address_v4::from_string(realHost), realPort);
+                                                   setEndpoint(asio::ip::udp::endpoint(
+                                                           asio::ip::address_v4::from_string(realHost), realPort));
                                                }
-                                               timer.expires_after(std::chrono::milliseconds(5000));
-                                               timer.async_wait(
-                                                       [this](asio::error_code ec) {
-                                                           if (!ec) {
-                                                               if (isRunning)
-                                                                   sendRequest();
-                                                           } else {
-                                                               std::cerr << "Waiting error: " << ec.message() << "\n";
-                                                           }
-                                                       }
-                                               );
+                                               scheduleRequest();
                                            } else {
                                                std::cerr << er.message() << "\n";
                                            }
-                                       });
+                                       }));
+        }
+
+        void scheduleRequest() {
+            timer.start(std::chrono::milliseconds(5000), [this] () {
+                if (isRunning)
+                    sendRequest();
+            });
+        }
+
+        // Passive mode is for sockets read by someone else, answers are fed through handleAnswer.
+        void setPassive() {
+            isPassive = true;
+        }
+
+        bool isServer(const asio::ip::udp::endpoint &from) const {
+            return from == ep_;
+        }
+
+        bool handleAnswer(const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length) {
+            if (from != ep_ || length < ansString_.size())
+                return false;
+            std::memcpy(ansString_.data(), data, ansString_.size());
+            setEndpoint(asio::ip::udp::endpoint(asio::ip::address_v4::from_string(getIpFromBytes()), getPortFromBytes()));
+            return true;
         }
 
         asio::ip::udp::endpoint getEndpoint() {
+            std::scoped_lock lock(epMutex_);
             return realEp_;
         }
 
@@ -87,26 +109,36 @@ namespace netlib {
             if (tempEp_ == ep_) {
                 std::string realHost = getIpFromBytes();
                 uint32_t realPort = getPortFromBytes();
-                realEp_ = asio::ip::udp::endpoint(
-                        asio::ip::address_v4::from_string(realHost), realPort);
+                setEndpoint(asio::ip::udp::endpoint(
+                        asio::ip::address_v4::from_string(realHost), realPort));
             }
             sendRequest();
         }
 
         void stop() {
             isRunning = false;
+            timer.cancel();
         }
 
     private:
-        asio::steady_timer timer;
+        // Answers land on the io threads, the endpoint is read from the update thread.
+        void setEndpoint(const asio::ip::udp::endpoint &ep) {
+            std::scoped_lock lock(epMutex_);
+            realEp_ = ep;
+        }
+
+        TimerWheel::Timer timer;
         asio::ip::udp::endpoint ep_;
         asio::ip::udp::endpoint tempEp_;
 
         asio::ip::udp::endpoint realEp_;
+        std::mutex epMutex_;
         asio::ip::udp::socket& socket_;
         asio::io_context* context_;
+        asio::any_io_executor executor_;
         std::vector<uint8_t> reqString_;
         std::vector<uint8_t> ansString_;
         bool isRunning;
+        bool isPassive = false;
     };
 }
\ No newline at end of file
@@ -5,14 +5,19 @@
 #include "netlib_typesenum.h"
 #include "netlib_nodeserver.h"
 
+// Longest the update thread sleeps without messages, in milliseconds.
+uint16_t NODE_IDLE_WAIT = 100;
+
 namespace netlib {
 
     class Node {
 
     public:
 
-        static void serverUpdateCircle(NodeServer &server, bool &isRunning, asio::ip::udp::endpoint &ep, std::mutex &mutex) {
+        static void serverUpdateCircle(NodeServer &server, std::atomic<bool> &isRunning, asio::ip::udp::endpoint &ep, std::mutex &mutex) {
             while (isRunning) {
+                // Sleeps until a session queues a message, the timeout only bounds how stale ep and stop() can get.
+                server.waitForMessages(std::chrono::milliseconds(NODE_IDLE_WAIT));
                 std::scoped_lock lock(mutex);
                 ep = server.updateNode();
             }
@@ -44,6 +49,7 @@ namespace netlib {
         }
 
         uint64_t getInviteCode() {
+            std::scoped_lock lock(mutex);
             std:: cout << m_curEp.address() << " " << m_curEp.port() << "\n";
             return ((uint64_t)(m_curEp.address().to_v4().to_ulong()) << 16) + m_curEp.port();
         }
@@ -55,6 +61,7 @@ namespace netlib {
         }
 
         void uploadFile(std::string &path) {
+            std::scoped_lock lock(mutex);
             m_server.uploadFile(path);
         }
 
@@ -63,10 +70,15 @@ namespace netlib {
             m_server.downloadFile(path);
         }
 
+        NodeServer::FlowStats getFlowStats() {
+            std::scoped_lock lock(mutex);
+            return m_server.getFlowStats();
+        }
+
     private:
         NodeServer m_server;
 
-        bool m_isRunning;
+        std::atomic<bool> m_isRunning;
         std::thread m_updateThread;
 
         asio::ip::udp::endpoint m_curEp;
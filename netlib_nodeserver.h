@@ -9,13 +9,20 @@
 #include "modules/netlib_sha1.h"
 
 const uint16_t MAX_CONNECTIONS = 20;
-const std::string VERSION = "0.1b";
+const std::string VERSION = "0.4b";
 const uint8_t MAX_TTL = 7;
 const uint32_t MAX_REQ_LIVE = 600;
 
 const uint16_t BETWEEN_REQ_TIME = 10;
+// Lower bound, chunks otherwise fill the session's probed path MTU.
 const uint32_t FILE_CHUNK_SIZE = 1024;
-const uint16_t FILE_PACK_NUM = 128;
+// Bytes a download may have granted ahead of what it received: the starting window and its bounds.
+const uint32_t FILE_CREDIT_MIN = 256 * 1024;
+const uint32_t FILE_CREDIT_MAX = 8 * 1024 * 1024;
+// Pieces requested from one peer at a time.
+const uint16_t PIPELINE_DEPTH = 4;
+// Seconds a peer may go without delivering a chunk before its pieces go to the other peers.
+const uint16_t PIECE_STALL_TIME = 5;
 
 namespace netlib {
 
@@ -23,20 +30,39 @@ namespace netlib {
     public:
         NodeServer(const std::string& localAddress, uint16_t port, std::string downloadsPath) :
                 Server<TypesEnum>(localAddress, port, TypesEnum::PingMsgType, TypesEnum::PongMsgType),
-                m_fileSystem(downloadsPath),
-                m_timer(*m_context)
+                m_fileSystem(downloadsPath)
         {
             rnd.seed(std::chrono::steady_clock::now().time_since_epoch().count());
             m_downloadsPath = std::move(downloadsPath);
+            if (USE_IO_URING)
+                m_pieceIo = UringFiles::create();
         }
 
         //=================================GENERAL=====================================
 
         asio::ip::udp::endpoint updateNode() {
             update();
+            retryPieces();
+            reclaimStalled();
+            // Piece writes of the whole update go to the kernel in one submission.
+            if (m_pieceIo)
+                m_pieceIo->flush();
             return getRealEp();
         }
 
+        // Retries are kept on the update thread, so no io handler ever touches the file state.
+        void retryPieces() {
+            auto now = std::chrono::steady_clock::now();
+            while (!m_pieceRetries.empty() && m_pieceRetries.begin()->first <= now) {
+                auto [id, handle] = m_pieceRetries.begin()->second;
+                m_pieceRetries.erase(m_pieceRetries.begin());
+                if (m_downloadsMap[id].find(handle) == m_downloadsMap[id].end())
+                    continue;
+                m_downloadsMap[id][handle].retryQueued = false;
+                requestNextPiece(id, handle);
+            }
+        }
+
         void onMessage(OwnedMessage<netlib::TypesEnum> &msg) override {
             uint16_t id = msg.session_->getId();
             if (checkConnectManager(msg.msg_)) {
@@ -250,8 +276,9 @@ namespace netlib {
                     || msg.m_header.id == TypesEnum::PathAddressPushMsgType;
         }
 
+        // Partial holders answer too, the puller learns which pieces from the bitfield.
         bool checkTarget(std::string &fileId) {
-            return m_fileSystem.checkFile(fileId);
+            return m_fileSystem.holdsPieces(fileId);
         }
 
         void sendResponse(uint16_t id, const std::string& reqId, const std::string& fileId) {
@@ -274,24 +301,26 @@ namespace netlib {
             return res;
         }
         
-        void updatePathManager(Message<TypesEnum> &msg, uint16_t id) {
+        void updatePathManager(const Message<TypesEnum> &msg, uint16_t id) {
+            MessageView<TypesEnum> view(msg);
             switch (msg.m_header.id) {
                 case TypesEnum::PathRequestPushMsgType: {
                     std::string reqId;
                     uint8_t TTL;
-                    std::string fileId;
-                    msg >> reqId >> TTL >> fileId;
+                    InfoHash hash;
+                    view >> reqId >> TTL >> hash;
+                    std::string fileId = toFileId(hash);
 
                     if (m_requestsMap.find(reqId) == m_requestsMap.end() ||
                         clock() - m_requestsMap[reqId].createdTime >= MAX_REQ_LIVE * CLOCKS_PER_SEC) {
                         m_requestsMap[reqId].createdTime = clock();
                         m_requestsMap[reqId].fromRequestId = id;
 
-                        msg << fileId << TTL << reqId;
+                        // A partial holder answers and keeps flooding, seeders further away may have the rest.
                         if (checkTarget(fileId)) {
-
                             sendResponse(id, reqId, fileId);
-                            break;
+                            if (m_fileSystem.checkFile(fileId))
+                                break;
                         }
 
                         TTL = std::max(MAX_TTL, TTL);
@@ -307,14 +336,13 @@ namespace netlib {
                                 continue;
                             ids.push_back(session.first);
                         }
-                        for (uint16_t id_: ids)
-                            sendMessage(id_, msg);
+                        broadcastMessage(ids, msg);
                     }
                     break;
                 }
                 case TypesEnum::PathResponsePullMsgType: {
                     std::string respId, reqId;
-                    msg >> respId >> reqId;
+                    view >> respId >> reqId;
                     if (m_requestsMap.find(reqId) == m_requestsMap.end() ||
                         (clock() - m_requestsMap[reqId].createdTime) > MAX_REQ_LIVE * CLOCKS_PER_SEC) {
                         break;
@@ -324,8 +352,7 @@ namespace netlib {
                     if (m_requestsMap[reqId].fromRequestId == 0) {
                         std::string address;
                         uint16_t port;
-                        msg >> port >> address;
-                        msg << address << port;
+                        view >> port >> address;
 
                         std::string realAddress = getRealEp().address().to_string();
                         uint16_t realPort = getRealEp().port();
@@ -338,14 +365,13 @@ namespace netlib {
                         sendMessage(id, req);
                     } else {
                         m_requestsMap[respId].fromRequestId = id;
-                        msg << reqId << respId;
                         sendMessage(m_requestsMap[reqId].fromRequestId, msg);
                     }
                     break;
                 }
                 case TypesEnum::PathAddressPushMsgType: {
                     std::string respId;
-                    msg >> respId;
+                    view >> respId;
                     if (m_requestsMap.find(respId) == m_requestsMap.end() ||
                         (clock() - m_requestsMap[respId].createdTime) > MAX_REQ_LIVE * CLOCKS_PER_SEC) {
                         break;
@@ -354,15 +380,13 @@ namespace netlib {
                     if (m_requestsMap[respId].fromRequestId == 0) {
                         std::string address;
                         uint16_t port;
-                        msg >> port >> address;
-                        msg << address << port;
+                        view >> port >> address;
 
                         uint16_t remoteId = connectToHost(address, port, m_requestsMap[respId].responseReservedId);
                         m_sessionsMap[remoteId]->m_type = Session<TypesEnum>::SessionType::FileSession;
                         sendBeginFile(remoteId, m_requestsMap[respId].fileId);
 
                     } else {
-                        msg << respId;
                         sendMessage(m_requestsMap[respId].fromRequestId, msg);
                     }
                     break;
@@ -375,7 +399,7 @@ namespace netlib {
             m_requestsMap[reqId].createdTime = clock();
             m_requestsMap[reqId].fileId = fileId;
             Message<TypesEnum> req(TypesEnum::PathRequestPushMsgType);
-            req << fileId << MAX_TTL << reqId;
+            req << toInfoHash(fileId) << MAX_TTL << reqId;
             std::vector<uint16_t> ids;
             for (auto& session: m_sessionsMap) {
                 if (!session.second->isConnected() || !session.second->isActive() ||
@@ -383,8 +407,7 @@ namespace netlib {
                     continue;
                 ids.push_back(session.first);
             }
-            for (uint16_t id_: ids)
-                sendMessage(id_, req);
+            broadcastMessage(ids, std::move(req));
         }
 
         struct Request {
@@ -397,15 +420,79 @@ namespace netlib {
 
         //======================================FILE SENDING=================================
 
-        void fileReady(uint16_t userId, std::string &fileId) {
-            m_filesMap[userId][fileId].pieceNum = 0;
+        struct PieceTransfer {
+            PieceFile fileStream;
+            uint64_t fileSize = 0;
+            std::chrono::steady_clock::time_point lastProgress;
+        };
+
+        // Byte credit of one handle. The uploader may send body bytes up to limit, the downloader
+        // moves limit on as bodies arrive. Both sides count every body byte of the handle, so the
+        // two counts agree whatever happens to single pieces.
+        struct Credit {
+            uint64_t bytes = 0;
+            uint64_t limit = 0;
+            // Downloader: window of the next grant, where the last one was made, and how long the
+            // uploader took to act on it, the round trip through both update threads.
+            uint32_t window = FILE_CREDIT_MIN;
+            uint64_t bytesAtGrant = 0;
+            uint64_t limitBeforeGrant = 0;
+            std::chrono::steady_clock::time_point grantedAt;
+            std::chrono::microseconds grantRtt{0};
+            // Uploader: when it ran out with bytes left to send, zero while it has credit.
+            std::chrono::steady_clock::time_point stalledSince;
+        };
+
+        struct FlowStats {
+            // Times an uploader ran out of credit with bytes left to send, and how long it waited in total.
+            uint64_t creditStalls = 0;
+            std::chrono::microseconds stalledTime{0};
+            uint64_t grantsSent = 0;
+            uint64_t grantsReceived = 0;
+        };
+
+        struct FileStruct {
+            std::string fileId;
+            Credit credit;
+            // No new pieces go to a peer that stalled until then.
+            std::chrono::steady_clock::time_point backoffUntil;
+            bool retryQueued = false;
+            // Pieces in flight on this handle, by number.
+            std::map<uint16_t, PieceTransfer> pieces;
+        };
+
+        void fileReady(uint16_t userId, const std::string &fileId) {
+            m_pendingFiles[userId].insert(fileId);
         }
 
-        void sendBeginFile(uint16_t userId, std::string &fileId) {
-            fileReady(userId, fileId);
+        // Offers the pieces we hold, the bitfield tells the puller which ones those are.
+        void sendBeginFile(uint16_t userId, const std::string &fileId) {
+            uint16_t handle = m_nextHandle++;
+            m_uploadsMap[userId][handle].fileId = fileId;
             Message<TypesEnum> req(TypesEnum::FileBeginPullMsgType);
-            req << fileId;
-            sendMessage(userId, req);
+            req << encodeBitfield(m_fileSystem.getBitfield(fileId)) << handle << toInfoHash(fileId);
+            sendMessage(userId, std::move(req));
+        }
+
+        bool uploadingTo(uint16_t userId, const std::string &fileId) {
+            for (auto &[handle, file]: m_uploadsMap[userId]) {
+                if (file.fileId == fileId)
+                    return true;
+            }
+            return false;
+        }
+
+        // Tells everyone pulling the file from us about a piece we just got.
+        void sendHave(const std::string &fileId, uint16_t pieceNum) {
+            for (auto &[id, files]: m_uploadsMap) {
+                for (auto &[handle, file]: files) {
+                    if (file.fileId != fileId)
+                        continue;
+                    Message<TypesEnum> msg(TypesEnum::FileHaveMsgType);
+                    msg << pieceNum << handle;
+                    sendMessage(id, std::move(msg));
+                }
+            }
         }
 
         static bool checkFileManager(Message<TypesEnum> &msg) {
@@ -413,6 +500,7 @@ namespace netlib {
                     TypesEnum::FileRequestMsgType, TypesEnum::FileBeginPullMsgType,
                     TypesEnum::FileBodyMsgType, TypesEnum::FileEndMsgType,
                     TypesEnum::FileRequestEndMsgType, TypesEnum::FileBodyRespMsgType,
+                    TypesEnum::FileCancelMsgType, TypesEnum::FileHaveMsgType,
             };
 
             for (TypesEnum type: checkArray) {
@@ -422,154 +510,367 @@ namespace netlib {
             return false;
         }
 
-        void requestNextPiece(uint16_t id, std::string fileId) {
-            if (m_fileSystem.checkFile(fileId)) {
-                finishRequesting(id, fileId);
+        // Tops the handle up to PIPELINE_DEPTH pieces in flight. Every peer offering the file
+        // draws from the file's PiecePicker, so peers only share a piece during endgame.
+        void requestNextPiece(uint16_t id, uint16_t handle) {
+            FileStruct &file = m_downloadsMap[id][handle];
+            if (m_fileSystem.checkFile(file.fileId)) {
+                finishRequesting(id, handle);
                 return;
             }
-            Message<TypesEnum> msg(TypesEnum::FileRequestMsgType);
-            uint16_t pieceNum = m_fileSystem.getNonePiece(fileId);
-            if (pieceNum == (uint16_t )-1) {
-                m_timer.expires_after(std::chrono::milliseconds(BETWEEN_REQ_TIME * 1000));
-                m_timer.async_wait([this, id, fileId](std::error_code ec) {
-                    if (!ec) {
-                        requestNextPiece(id, fileId);
-                    } else {
-                        std::cerr << "Waiting error: " << ec.message() << "\n";
-                    }
-                });
+            if (m_sessionsMap.find(id) == m_sessionsMap.end()) {
+                releasePieces(id, handle, file);
+                m_fileSystem.removePeer(file.fileId, id);
+                m_downloadsMap[id].erase(handle);
+                return;
+            }
+            if (std::chrono::steady_clock::now() < file.backoffUntil) {
+                queueRetry(id, handle, file, file.backoffUntil);
+                return;
+            }
+            while (file.pieces.size() < PIPELINE_DEPTH) {
+                uint16_t pieceNum = m_fileSystem.pickPiece(file.fileId, id);
+                if (pieceNum == (uint16_t )-1)
+                    break;
+                // Still streaming from this peer, a second request would restart it at offset 0.
+                if (file.pieces.find(pieceNum) != file.pieces.end())
+                    break;
+                // An endgame copy shares the file with the one already coming in, same bytes at the same offsets.
+                bool shared = pieceInFlight(file.fileId, pieceNum);
+                PieceTransfer &piece = file.pieces[pieceNum];
+                piece.lastProgress = std::chrono::steady_clock::now();
+                piece.fileStream.open(m_fileSystem.getPath(file.fileId, pieceNum), true, m_pieceIo.get(), !shared);
+                Message<TypesEnum> msg(TypesEnum::FileRequestMsgType);
+                msg << file.credit.limit << pieceNum << handle;
+                sendMessage(id, std::move(msg));
+            }
+            if (file.pieces.empty())
+                queueRetry(id, handle, file, std::chrono::steady_clock::now() + std::chrono::seconds(BETWEEN_REQ_TIME));
+        }
+
+        // At most one retry per handle is queued, one due before the backoff ends queues the next.
+        void queueRetry(uint16_t id, uint16_t handle, FileStruct &file, std::chrono::steady_clock::time_point at) {
+            if (file.retryQueued)
+                return;
+            file.retryQueued = true;
+            m_pieceRetries.insert({at, {id, handle}});
+        }
+
+        // Lets the other peers of the file pick up pieces that just became free.
+        void requestFromPeers(const std::string &fileId) {
+            std::vector<std::pair<uint16_t, uint16_t>> handles;
+            for (auto &[id, files]: m_downloadsMap) {
+                for (auto &[handle, file]: files) {
+                    if (file.fileId == fileId && file.pieces.size() < PIPELINE_DEPTH)
+                        handles.push_back({id, handle});
+                }
+            }
+            for (auto [id, handle]: handles) {
+                if (m_downloadsMap[id].find(handle) != m_downloadsMap[id].end())
+                    requestNextPiece(id, handle);
+            }
+        }
+
+        // The uploader is told to drop them too, otherwise it keeps streaming them ahead of the re-picked ones.
+        void releasePieces(uint16_t id, uint16_t handle, FileStruct &file) {
+            bool connected = m_sessionsMap.find(id) != m_sessionsMap.end();
+            for (auto &[pieceNum, piece]: file.pieces) {
+                piece.fileStream.close();
+                m_fileSystem.releasePiece(file.fileId, pieceNum, id);
+                if (!connected)
+                    continue;
+                Message<TypesEnum> msg(TypesEnum::FileCancelMsgType);
+                msg << pieceNum << handle;
+                sendMessage(id, std::move(msg));
+            }
+            file.pieces.clear();
+        }
+
+        bool pieceInFlight(const std::string &fileId, uint16_t pieceNum) {
+            for (auto &[id, files]: m_downloadsMap) {
+                for (auto &[handle, file]: files) {
+                    if (file.fileId == fileId && file.pieces.count(pieceNum))
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        // The piece is in, endgame copies still coming from other peers are called off.
+        void cancelDuplicates(const std::string &fileId, uint16_t pieceNum) {
+            for (auto &[id, files]: m_downloadsMap) {
+                for (auto &[handle, file]: files) {
+                    if (file.fileId != fileId)
+                        continue;
+                    auto it = file.pieces.find(pieceNum);
+                    if (it == file.pieces.end())
+                        continue;
+                    file.pieces.erase(it);
+                    Message<TypesEnum> msg(TypesEnum::FileCancelMsgType);
+                    msg << pieceNum << handle;
+                    sendMessage(id, std::move(msg));
+                }
             }
-            else {
-                m_filesMap[id][fileId].pieceNum = pieceNum;
-                m_filesMap[id][fileId].fileStream.open(m_fileSystem.getPath(fileId, pieceNum), std::ios::out | std::ios::binary);
-                msg << pieceNum << fileId;
-                sendMessage(id, msg);
+        }
+
+        // A peer that delivered nothing for PIECE_STALL_TIME loses its pieces to the others and backs off.
+        void reclaimStalled() {
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::pair<uint16_t, uint16_t>> stalled;
+            for (auto &[id, files]: m_downloadsMap) {
+                for (auto &[handle, file]: files) {
+                    if (file.pieces.empty())
+                        continue;
+                    bool moving = false;
+                    for (auto &[pieceNum, piece]: file.pieces)
+                        moving |= now - piece.lastProgress < std::chrono::seconds(PIECE_STALL_TIME);
+                    if (!moving)
+                        stalled.push_back({id, handle});
+                }
+            }
+            for (auto [id, handle]: stalled) {
+                FileStruct &file = m_downloadsMap[id][handle];
+                std::cout << "[FILE-RECEIVER]: Peer " << id << " stalled, reassigning " << file.pieces.size() << " pieces\n";
+                releasePieces(id, handle, file);
+                file.backoffUntil = now + std::chrono::seconds(BETWEEN_REQ_TIME);
+                queueRetry(id, handle, file, file.backoffUntil);
+                requestFromPeers(file.fileId);
             }
         }
 
-        void finishRequesting(uint16_t id, std::string &fileId) {
+        void finishRequesting(uint16_t id, uint16_t handle) {
             std::cout << "[FILE-SENDER]: Finish requesting\n";
-            m_filesMap[id].erase(fileId);
+            m_fileSystem.removePeer(m_downloadsMap[id][handle].fileId, id);
+            m_downloadsMap[id].erase(handle);
             Message<TypesEnum> msg(TypesEnum::FileRequestEndMsgType);
-            msg << fileId;
-            sendMessage(id, msg);
+            msg << handle;
+            sendMessage(id, std::move(msg));
         }
 
-        void finishSending(uint16_t id, std::string &fileId) {
+        void finishSending(uint16_t id, uint16_t handle, uint16_t pieceNum) {
             std::cout << "[FILE-SENDER]: Finish sending\n";
             Message<TypesEnum> msg(TypesEnum::FileEndMsgType);
-            msg << fileId;
-            sendMessage(id, msg);
+            msg << pieceNum << handle;
+            sendMessage(id, std::move(msg));
         }
 
-        void nextBodyPiece(uint16_t id, std::string &fileId) {
-            if (!m_filesMap[id][fileId].fileStream.is_open()) {
-                return;
+        uint32_t chunkSize(uint16_t id) {
+            // Room for the varint length prefix and the handle.
+            size_t maxBody = getMaxBodySize(id);
+            return std::max<uint32_t>(FILE_CHUNK_SIZE, maxBody - sizeof(uint16_t) - 5);
+        }
+
+        // Sends the piece's next chunk, at most limit bytes of it, and returns the bytes sent. A finished
+        // or unreadable piece is dropped, a short read sends what it got and ends the piece.
+        uint32_t nextBodyPiece(uint16_t id, FileStruct &file, uint16_t handle, uint16_t pieceNum, uint64_t limit) {
+            auto it = file.pieces.find(pieceNum);
+            if (it == file.pieces.end())
+                return 0;
+            PieceTransfer &piece = it->second;
+            if (!piece.fileStream.isOpen()) {
+                file.pieces.erase(it);
+                return 0;
             }
-            uint32_t bytesLeft = m_filesMap[id][fileId].fileSize - m_filesMap[id][fileId].fileStream.tellg();
+            uint32_t bytesLeft = piece.fileSize - piece.fileStream.offset();
             if (bytesLeft == 0) {
-                m_filesMap[id][fileId].fileStream.close();
-                finishSending(id, fileId);
-            } else {
-                std::cout << "[FILE-SENDER]: " << bytesLeft << " " << "bytes left\n";
-                std::vector<char> buffer(std::min(bytesLeft, FILE_CHUNK_SIZE));
-                m_filesMap[id][fileId].fileStream.read(buffer.data(), buffer.size());
+                file.pieces.erase(it);
+                finishSending(id, handle, pieceNum);
+                return 0;
+            }
+            std::cout << "[FILE-SENDER]: " << bytesLeft << " " << "bytes left\n";
+            size_t wanted = std::min<uint64_t>({bytesLeft, chunkSize(id), limit});
+            m_chunkBuffer.resize(wanted);
+            m_chunkBuffer.resize(piece.fileStream.read(m_chunkBuffer.data(), wanted));
+            if (!m_chunkBuffer.empty()) {
                 Message<TypesEnum> msg(TypesEnum::FileBodyMsgType);
-                msg << buffer << fileId;
-                sendMessage(id, msg);
+                msg << m_chunkBuffer << pieceNum << handle;
+                sendMessage(id, std::move(msg));
+            }
+            if (m_chunkBuffer.size() < wanted) {
+                // The file shrank or failed under us, end the piece early, the receiver's SHA-1 check rejects it.
+                std::cout << "[FILE-SENDER]: Short read of piece " << pieceNum << "\n";
+                file.pieces.erase(it);
+                finishSending(id, handle, pieceNum);
+            }
+            return m_chunkBuffer.size();
+        }
+
+        // Streams the handle's pieces, lowest first, for as long as the downloader's credit lasts.
+        void sendChunks(uint16_t id, uint16_t handle) {
+            FileStruct &file = m_uploadsMap[id][handle];
+            Credit &credit = file.credit;
+            while (!file.pieces.empty() && credit.bytes < credit.limit)
+                credit.bytes += nextBodyPiece(id, file, handle, file.pieces.begin()->first, credit.limit - credit.bytes);
+            if (!file.pieces.empty() && credit.stalledSince == std::chrono::steady_clock::time_point()) {
+                credit.stalledSince = std::chrono::steady_clock::now();
+                m_flowStats.creditStalls++;
             }
         }
 
+        // Grants only move the limit forward, a stale one changes nothing.
+        void addCredit(Credit &credit, uint64_t limit) {
+            if (limit <= credit.limit)
+                return;
+            credit.limit = limit;
+            if (credit.stalledSince != std::chrono::steady_clock::time_point()) {
+                m_flowStats.stalledTime += std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - credit.stalledSince);
+                credit.stalledSince = {};
+            }
+        }
+
+        // Once half the last window has come in, grants another from here. The window is twice
+        // what the update thread drained per round trip since the last grant, and halves while
+        // messages queue up in front of it, which means bodies arrive faster than they are written.
+        void grantCredit(uint16_t id, uint16_t handle, Credit &credit) {
+            auto now = std::chrono::steady_clock::now();
+            // The first byte past the previous limit could only be sent once the grant got there.
+            if (credit.limitBeforeGrant && credit.bytes > credit.limitBeforeGrant) {
+                credit.grantRtt = std::chrono::duration_cast<std::chrono::microseconds>(now - credit.grantedAt);
+                credit.limitBeforeGrant = 0;
+            }
+            if (credit.bytes + credit.window / 2 < credit.limit)
+                return;
+            double seconds = std::chrono::duration<double>(now - credit.grantedAt).count();
+            std::optional<Session<TypesEnum>::Stats> stats = getSessionStats(id);
+            std::chrono::microseconds rtt = std::max(credit.grantRtt, stats ? stats->srtt : std::chrono::microseconds(0));
+            if (seconds > 0 && rtt.count() > 0) {
+                double perRtt = (credit.bytes - credit.bytesAtGrant) / seconds * rtt.count() / 1e6;
+                credit.window = std::clamp<double>(2 * perRtt, FILE_CREDIT_MIN, FILE_CREDIT_MAX);
+            }
+            if (m_queueIn.size() * chunkSize(id) > credit.window / 2)
+                credit.window = std::max<uint32_t>(credit.window / 2, FILE_CREDIT_MIN);
+            credit.limitBeforeGrant = credit.limit;
+            credit.limit = credit.bytes + credit.window;
+            credit.bytesAtGrant = credit.bytes;
+            credit.grantedAt = now;
+            m_flowStats.grantsSent++;
+            Message<TypesEnum> resp(TypesEnum::FileBodyRespMsgType);
+            resp << credit.limit << handle;
+            sendMessage(id, std::move(resp));
+        }
+
         void updateFileManager(Message<TypesEnum> &msg, uint16_t id) {
+            uint16_t handle;
             switch (msg.m_header.id) {
                 case TypesEnum::FileBeginPullMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
+                    InfoHash hash;
+                    std::vector<uint8_t> bitfield;
+                    msg >> hash >> handle >> bitfield;
+                    std::string fileId = toFileId(hash);
+                    // Besides the answers to our path requests, partial holders we serve offer their pieces back.
+                    if (m_pendingFiles[id].erase(fileId) == 0 && !(m_fileSystem.wantsFile(fileId) && uploadingTo(id, fileId))) {
+                        Message<TypesEnum> end(TypesEnum::FileRequestEndMsgType);
+                        end << handle;
+                        sendMessage(id, std::move(end));
                         break;
-                    requestNextPiece(id, fileId);
+                    }
+                    std::vector<bool> pieces = decodeBitfield(bitfield, m_fileSystem.pieceCount(fileId));
+                    FileStruct &file = m_downloadsMap[id][handle];
+                    file.fileId = fileId;
+                    file.credit.limit = file.credit.window;
+                    file.credit.grantedAt = std::chrono::steady_clock::now();
+                    m_fileSystem.addPeer(fileId, id, pieces);
+                    // A peer still missing pieces gets ours offered back, and our haves from then on.
+                    if (!uploadingTo(id, fileId) && std::find(pieces.begin(), pieces.end(), false) != pieces.end())
+                        sendBeginFile(id, fileId);
+                    requestNextPiece(id, handle);
                     break;
                 }
                 case TypesEnum::FileRequestMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
-                        break;
-                    if (!m_fileSystem.checkFile(fileId))
+                    msg >> handle;
+                    if (m_uploadsMap[id].find(handle) == m_uploadsMap[id].end())
                         break;
+                    FileStruct &file = m_uploadsMap[id][handle];
                     uint16_t pieceNum;
-                    msg >> pieceNum;
+                    uint64_t limit;
+                    msg >> pieceNum >> limit;
+                    addCredit(file.credit, limit);
+                    if (!m_fileSystem.hasPiece(file.fileId, pieceNum))
+                        break;
                     std::cout << "[FILE-SENDER]: New piece with number " << pieceNum << "\n";
-                    std::string path = m_fileSystem.getPath(fileId, pieceNum);
-                    m_filesMap[id][fileId].fileSize = std::filesystem::file_size(path);
-                    m_filesMap[id][fileId].fileStream.open(path, std::ios::binary | std::ios::in);
-                    for (int i = 0; i < FILE_PACK_NUM; i++) {
-                        nextBodyPiece(id, fileId);
-                        if (!m_filesMap[id][fileId].fileStream.is_open())
-                            break;
-                    }
+                    std::string path = m_fileSystem.getPath(file.fileId, pieceNum);
+                    PieceTransfer &piece = file.pieces[pieceNum];
+                    piece.fileSize = std::filesystem::file_size(path);
+                    piece.fileStream.open(path, false, m_pieceIo.get());
+                    sendChunks(id, handle);
                     break;
                 }
                 case TypesEnum::FileEndMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
+                    uint16_t pieceNum;
+                    msg >> handle >> pieceNum;
+                    if (m_downloadsMap[id].find(handle) == m_downloadsMap[id].end())
+                        break;
+                    FileStruct &file = m_downloadsMap[id][handle];
+                    // Gone if it was reassigned after a stall.
+                    auto it = file.pieces.find(pieceNum);
+                    if (it == file.pieces.end())
                         break;
-                    m_filesMap[id][fileId].fileStream.close();
-                    m_fileSystem.addPiece(fileId, m_filesMap[id][fileId].pieceNum);
-                    std::cout << "[FILE-RECEIVER]: " << "New piece number " << m_filesMap[id][fileId].pieceNum << " got\n";
-                    requestNextPiece(id, fileId);
+                    it->second.fileStream.close();
+                    file.pieces.erase(it);
+                    std::string fileId = file.fileId;
+                    if (m_fileSystem.addPiece(fileId, pieceNum)) {
+                        cancelDuplicates(fileId, pieceNum);
+                        sendHave(fileId, pieceNum);
+                    }
+                    std::cout << "[FILE-RECEIVER]: " << "New piece number " << pieceNum << " got from " << id << "\n";
+                    requestFromPeers(fileId);
                     break;
                 }
                 case TypesEnum::FileBodyMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
-                        break;
-                    if (!m_filesMap[id][fileId].fileStream.is_open()) {
+                    uint16_t pieceNum;
+                    msg >> handle >> pieceNum;
+                    if (m_downloadsMap[id].find(handle) == m_downloadsMap[id].end())
                         break;
+                    FileStruct &file = m_downloadsMap[id][handle];
+                    msg >> m_chunkBuffer;
+                    // Bodies of cancelled or reclaimed pieces still used up credit.
+                    file.credit.bytes += m_chunkBuffer.size();
+                    auto it = file.pieces.find(pieceNum);
+                    if (it != file.pieces.end() && it->second.fileStream.isOpen()) {
+                        it->second.fileStream.write(m_chunkBuffer.data(), m_chunkBuffer.size());
+                        it->second.lastProgress = std::chrono::steady_clock::now();
                     }
-                    std::vector<char> vec;
-                    msg >> vec;
-                    m_filesMap[id][fileId].fileStream.write(vec.data(), vec.size());
-                    currentPackNum++;
-                    if (currentPackNum == FILE_PACK_NUM) {
-                        currentPackNum = 0;
-                        Message<TypesEnum> resp(TypesEnum::FileBodyRespMsgType);
-                        resp << fileId;
-                        sendMessage(id, resp);
-                    }
+                    grantCredit(id, handle, file.credit);
                     break;
                 }
                 case TypesEnum::FileBodyRespMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
+                    uint64_t limit;
+                    msg >> handle >> limit;
+                    if (m_uploadsMap[id].find(handle) == m_uploadsMap[id].end())
                         break;
-                    for (int i = 0; i < FILE_PACK_NUM; i++) {
-                        nextBodyPiece(id, fileId);
-                        if (!m_filesMap[id][fileId].fileStream.is_open())
-                            break;
-                    }
+                    m_flowStats.grantsReceived++;
+                    addCredit(m_uploadsMap[id][handle].credit, limit);
+                    sendChunks(id, handle);
+                    break;
+                }
+                case TypesEnum::FileCancelMsgType: {
+                    uint16_t pieceNum;
+                    msg >> handle >> pieceNum;
+                    if (m_uploadsMap[id].find(handle) == m_uploadsMap[id].end())
+                        break;
+                    m_uploadsMap[id][handle].pieces.erase(pieceNum);
+                    break;
+                }
+                case TypesEnum::FileHaveMsgType: {
+                    uint16_t pieceNum;
+                    msg >> handle >> pieceNum;
+                    if (m_downloadsMap[id].find(handle) == m_downloadsMap[id].end())
+                        break;
+                    m_fileSystem.peerHas(m_downloadsMap[id][handle].fileId, id, pieceNum);
+                    requestNextPiece(id, handle);
                     break;
                 }
                 case TypesEnum::FileRequestEndMsgType: {
-                    std::string fileId;
-                    msg >> fileId;
-                    if (m_filesMap[id].find(fileId) == m_filesMap[id].end())
+                    msg >> handle;
+                    if (m_uploadsMap[id].find(handle) == m_uploadsMap[id].end())
                         break;
-                    m_filesMap[id].erase(fileId);
+                    m_uploadsMap[id].erase(handle);
                     break;
                 }
             }
         }
 
-        struct FileStruct {
-            std::fstream fileStream;
-            uint16_t pieceNum;
-            uint64_t fileSize;
-        };
-
         //==============================High-Level Functions=====================================
 
         void uploadFile(std::string &filePath) {
@@ -582,6 +883,10 @@ namespace netlib {
                 sendPathRequest(fileId);
         }
 
+        FlowStats getFlowStats() {
+            return m_flowStats;
+        }
+
     private:
 
         std::string m_downloadsPath;
@@ -590,15 +895,26 @@ namespace netlib {
 
         std::map<std::string, Request> m_requestsMap;
 
-        std::map<uint16_t, std::map<std::string, FileStruct>> m_filesMap;
+        // Handles are allocated by the uploading side, so both directions get their own map.
+        std::map<uint16_t, std::map<uint16_t, FileStruct>> m_uploadsMap;
+
+        std::map<uint16_t, std::map<uint16_t, FileStruct>> m_downloadsMap;
+
+        std::map<uint16_t, std::set<std::string>> m_pendingFiles;
 
-        asio::steady_timer m_timer;
+        uint16_t m_nextHandle = 0;
+
+        std::multimap<std::chrono::steady_clock::time_point, std::pair<uint16_t, uint16_t>> m_pieceRetries;
 
 
         FileSystem m_fileSystem;
 
+        std::unique_ptr<UringFiles> m_pieceIo;
+
         std::mt19937 rnd;
 
-        uint16_t currentPackNum = 0;
+        std::vector<char> m_chunkBuffer;
+
+        FlowStats m_flowStats;
     };
 }
\ No newline at end of file
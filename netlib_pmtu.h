@@ -0,0 +1,114 @@
+#pragma once
+
+#include "netlib_header.h"
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#endif
+
+uint16_t PMTU_BASE = 1200;
+uint16_t PMTU_MAX_PROBES = 3;
+uint16_t PMTU_SEARCH_STEP = 16;
+uint32_t PMTU_RAISE_INTERVAL = 600000;
+
+namespace netlib {
+
+#if defined(__linux__) || defined(_WIN32)
+    constexpr bool DONT_FRAGMENT_SUPPORTED = true;
+#else
+    constexpr bool DONT_FRAGMENT_SUPPORTED = false;
+#endif
+
+    // Sets DF on datagrams sent after the call, false where the platform gives no control over it.
+    inline bool setDontFragment(asio::ip::udp::socket &socket, bool enabled) {
+#if defined(__linux__)
+        int value = enabled ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+        return ::setsockopt(socket.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) == 0;
+#elif defined(_WIN32)
+        DWORD value = enabled ? 1 : 0;
+        return ::setsockopt(socket.native_handle(), IPPROTO_IP, IP_DONTFRAGMENT,
+                            reinterpret_cast<const char *>(&value), sizeof(value)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Packetization-layer PMTU search (RFC 8899 style). Sizes are whole UDP payloads.
+    // Common link MTUs are tried first, then the gap to the smallest failed size is bisected.
+    class PmtuProber {
+    public:
+        explicit PmtuProber(size_t maxSize) : m_maxSize(std::max<size_t>(maxSize, PMTU_BASE)) {
+            reset();
+        }
+
+        void reset() {
+            m_confirmed = PMTU_BASE;
+            m_failed = m_maxSize + 1;
+            m_probeSize = 0;
+            m_attempts = 0;
+        }
+
+        size_t confirmed() const {
+            return m_confirmed;
+        }
+
+        bool searching() const {
+            return m_failed - m_confirmed > PMTU_SEARCH_STEP;
+        }
+
+        size_t probeSize() const {
+            return m_probeSize;
+        }
+
+        // Size to probe next, 0 when the search is over.
+        size_t nextProbe() {
+            if (!searching())
+                return m_probeSize = 0;
+            if (m_probeSize != 0)
+                return m_probeSize;
+            for (size_t candidate: {(size_t)1472, (size_t)8972, (size_t)65507}) {
+                size_t size = std::min(candidate, m_maxSize);
+                if (size > m_confirmed && size < m_failed)
+                    return m_probeSize = size;
+            }
+            return m_probeSize = m_confirmed + (m_failed - m_confirmed) / 2;
+        }
+
+        // Search again above the confirmed size, RFC 8899 raise timer.
+        void raise() {
+            m_failed = m_maxSize + 1;
+        }
+
+        void onAck(size_t size) {
+            if (size <= m_confirmed || size >= m_failed)
+                return;
+            m_confirmed = size;
+            if (size == m_probeSize) {
+                m_probeSize = 0;
+                m_attempts = 0;
+            }
+        }
+
+        void onLost() {
+            if (m_probeSize == 0)
+                return;
+            if (++m_attempts >= PMTU_MAX_PROBES)
+                onTooBig();
+        }
+
+        void onTooBig() {
+            if (m_probeSize == 0)
+                return;
+            m_failed = m_probeSize;
+            m_probeSize = 0;
+            m_attempts = 0;
+        }
+
+    private:
+        size_t m_maxSize;
+        size_t m_confirmed = 0;
+        size_t m_failed = 0;
+        size_t m_probeSize = 0;
+        uint16_t m_attempts = 0;
+    };
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "netlib_header.h"
+
+namespace netlib {
+
+    // Receive-side reorder ring. Slot for sequence id is id % capacity, ids
+    // accepted are (delivered, delivered + capacity].
+    template<typename M>
+    class ReorderBuffer {
+    public:
+        explicit ReorderBuffer(size_t capacity) : m_slots(std::max<size_t>(capacity, 1)),
+                                                  m_present(m_slots.size(), false) {}
+
+        ReorderBuffer(const ReorderBuffer &) = delete;
+
+        size_t capacity() const {
+            return m_slots.size();
+        }
+
+        uint64_t delivered() const {
+            return m_delivered;
+        }
+
+        uint64_t highest() const {
+            return m_highest;
+        }
+
+        bool inWindow(uint64_t id) const {
+            return id > m_delivered && id - m_delivered <= m_slots.size();
+        }
+
+        bool contains(uint64_t id) const {
+            return inWindow(id) && m_present[id % m_slots.size()];
+        }
+
+        // Returns false for ids already delivered, already buffered or beyond the window.
+        bool insert(uint64_t id, M &&item) {
+            if (!inWindow(id))
+                return false;
+            size_t slot = id % m_slots.size();
+            if (m_present[slot])
+                return false;
+            m_slots[slot] = std::move(item);
+            m_present[slot] = true;
+            m_highest = std::max(m_highest, id);
+            return true;
+        }
+
+        template<typename F>
+        void drain(F &&consume) {
+            while (true) {
+                size_t slot = (m_delivered + 1) % m_slots.size();
+                if (!m_present[slot])
+                    break;
+                m_present[slot] = false;
+                m_delivered++;
+                consume(std::move(m_slots[slot]));
+            }
+            m_highest = std::max(m_highest, m_delivered);
+        }
+
+        // Visits buffered ids above the delivered one in ascending order.
+        template<typename F>
+        void forEachPending(F &&visit) const {
+            for (uint64_t id = m_delivered + 1; id <= m_highest; id++) {
+                if (m_present[id % m_slots.size()] && !visit(id))
+                    return;
+            }
+        }
+
+    private:
+        std::vector<M> m_slots;
+        std::vector<bool> m_present;
+        uint64_t m_delivered = 0;
+        uint64_t m_highest = 0;
+    };
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "netlib_header.h"
+#include "netlib_session.h"
+#include "netlib_natkiller.h"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <linux/filter.h>
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#endif
+
+// Independent runtimes a Server splits its sessions over, each with its own io_context, timers and socket.
+uint16_t SHARDS = 1;
+
+namespace netlib {
+
+    // Lets several sockets bind the same port, the kernel spreads datagrams over them.
+    inline bool enableReusePort(asio::ip::udp::socket &socket) {
+#if defined(__linux__)
+        int on = 1;
+        return ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Classic BPF for the socket's SO_REUSEPORT group: a datagram goes to the socket that joined
+    // (dstId % shards)-th, which is the shard owning that session. STUN answers go to the first
+    // socket, dstId == 0 (peer has not heard from us yet) falls back to the kernel's flow hash.
+    inline bool steerByChannel(asio::ip::udp::socket &socket, uint16_t shards) {
+#if defined(__linux__)
+        constexpr uint32_t DST = offsetof(ChannelHeader, dstId);
+        constexpr bool LITTLE = std::endian::native == std::endian::little;
+        sock_filter code[] = {
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, StunSession::TRANSACTION_WORD, 8, 0),
+                // Loads are big-endian, dstId is stored in host order.
+                BPF_STMT(BPF_LD | BPF_B | BPF_ABS, LITTLE ? DST + 1 : DST),
+                BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+                BPF_STMT(BPF_MISC | BPF_TAX, 0),
+                BPF_STMT(BPF_LD | BPF_B | BPF_ABS, LITTLE ? DST : DST + 1),
+                BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 0),
+                BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+                BPF_STMT(BPF_RET | BPF_A, 0),
+                BPF_STMT(BPF_RET | BPF_K, 0),
+                // Out of range, the kernel picks by hash.
+                BPF_STMT(BPF_RET | BPF_K, shards),
+        };
+        sock_fprog program{sizeof(code) / sizeof(code[0]), code};
+        return ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+        return false;
+#endif
+    }
+}
@@ -2,67 +2,299 @@
 #define NTORRENT_NETLIB_SAFEQUEUE_H
 #include "netlib_header.h"
 namespace netlib {
+
+    // Lets a single consumer sleep until a producer publishes something. Producers
+    // only touch the mutex when the consumer is actually asleep.
+    class QueueSignal {
+    public:
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!m_waiting.load(std::memory_order_relaxed))
+                return;
+            std::scoped_lock lock(m_mutex);
+            m_cv.notify_one();
+        }
+
+        template<typename Rep, typename Period, typename F>
+        bool waitFor(std::chrono::duration<Rep, Period> timeout, F &&ready) {
+            if (ready())
+                return true;
+            std::unique_lock lock(m_mutex);
+            m_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool result = m_cv.wait_for(lock, timeout, ready);
+            m_waiting.store(false, std::memory_order_relaxed);
+            return result;
+        }
+
+        template<typename F>
+        void wait(F &&ready) {
+            while (!waitFor(std::chrono::hours(1), ready)) {}
+        }
+
+    private:
+        std::atomic<bool> m_waiting = false;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+    };
+
+    // Unbounded single-producer single-consumer queue: a linked list of fixed
+    // blocks, each published with one release store per push or batch.
+    // front() and pop_front() belong to the consumer, push_back() to the producer.
     template<typename T>
-    class SafeQueue {
+    class SpscQueue {
+        static constexpr size_t BLOCK_SIZE = 64;
+
+        struct Block {
+            std::array<std::optional<T>, BLOCK_SIZE> slots;
+            std::atomic<size_t> written = 0;
+            std::atomic<Block *> next = nullptr;
+        };
+
     public:
-        SafeQueue() = default;
+        SpscQueue() : m_head(new Block()), m_tail(m_head) {}
+
+        SpscQueue(const SpscQueue &) = delete;
 
-        SafeQueue(const SafeQueue<T> &) = delete;
+        ~SpscQueue() {
+            while (m_head) {
+                Block *next = m_head->next.load(std::memory_order_relaxed);
+                delete m_head;
+                m_head = next;
+            }
+            delete m_spare.load(std::memory_order_relaxed);
+        }
 
-        virtual ~SafeQueue() { clear(); }
+        void push_back(const T &item) {
+            push_back(T(item));
+        }
 
+        void push_back(T &&item) {
+            emplace(std::move(item));
+            publish();
+        }
+
+        void push_batch(std::vector<T> &&items) {
+            for (T &item: items)
+                emplace(std::move(item));
+            items.clear();
+            publish();
+        }
+
+        bool empty() {
+            return !readable();
+        }
+
+        size_t size() const {
+            return m_size.load(std::memory_order_acquire);
+        }
+
+        // Valid until the next pop, the queue must not be empty.
         T &front() {
-            std::scoped_lock lock(mutex_);
-            return deque_.front();
+            readable();
+            return *m_head->slots[m_read];
+        }
+
+        T pop_front() {
+            readable();
+            T item = std::move(*m_head->slots[m_read]);
+            m_head->slots[m_read++].reset();
+            m_size.fetch_sub(1, std::memory_order_release);
+            return item;
+        }
+
+        // Moves up to max items into out, returns how many.
+        size_t pop_batch(std::vector<T> &out, size_t max = SIZE_MAX) {
+            size_t count = 0;
+            while (count < max && readable()) {
+                size_t available = std::min(m_head->written.load(std::memory_order_acquire) - m_read, max - count);
+                for (size_t i = 0; i < available; i++) {
+                    out.push_back(std::move(*m_head->slots[m_read]));
+                    m_head->slots[m_read++].reset();
+                }
+                count += available;
+            }
+            m_size.fetch_sub(count, std::memory_order_release);
+            return count;
+        }
+
+        void clear() {
+            while (readable())
+                pop_front();
+        }
+
+        template<typename Rep, typename Period>
+        bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+            return m_signal.waitFor(timeout, [this] { return readable(); });
+        }
+
+        void wait() {
+            m_signal.wait([this] { return readable(); });
+        }
+
+    private:
+        void emplace(T &&item) {
+            if (m_write == BLOCK_SIZE) {
+                Block *block = m_spare.exchange(nullptr, std::memory_order_acquire);
+                if (!block)
+                    block = new Block();
+                block->written.store(0, std::memory_order_relaxed);
+                block->next.store(nullptr, std::memory_order_relaxed);
+                m_tail->written.store(m_write, std::memory_order_release);
+                m_tail->next.store(block, std::memory_order_release);
+                m_tail = block;
+                m_write = 0;
+            }
+            m_tail->slots[m_write++].emplace(std::move(item));
+            m_pending++;
+        }
+
+        void publish() {
+            m_size.fetch_add(m_pending, std::memory_order_release);
+            m_pending = 0;
+            m_tail->written.store(m_write, std::memory_order_release);
+            m_signal.notify();
         }
 
-        T &back() {
-            std::scoped_lock lock(mutex_);
-            return deque_.back();
+        // Steps over drained blocks, keeps the last one around for the producer.
+        bool readable() {
+            while (true) {
+                if (m_read < m_head->written.load(std::memory_order_acquire))
+                    return true;
+                if (m_read < BLOCK_SIZE)
+                    return false;
+                Block *next = m_head->next.load(std::memory_order_acquire);
+                if (!next)
+                    return false;
+                Block *old = m_head;
+                m_head = next;
+                m_read = 0;
+                delete m_spare.exchange(old, std::memory_order_acq_rel);
+            }
+        }
+
+        // Consumer side.
+        Block *m_head;
+        size_t m_read = 0;
+        // Producer side.
+        Block *m_tail;
+        size_t m_write = 0;
+        size_t m_pending = 0;
+
+        std::atomic<Block *> m_spare = nullptr;
+        std::atomic<size_t> m_size = 0;
+        QueueSignal m_signal;
+    };
+
+    // Unbounded multi-producer single-consumer queue (Vyukov). A push is one
+    // atomic exchange, a batch is linked up front and also costs one exchange.
+    template<typename T>
+    class MpscQueue {
+        struct Node {
+            std::atomic<Node *> next = nullptr;
+            std::optional<T> value;
+        };
+
+    public:
+        MpscQueue() : m_stub(new Node()), m_back(m_stub) {}
+
+        MpscQueue(const MpscQueue &) = delete;
+
+        ~MpscQueue() {
+            while (m_stub) {
+                Node *next = m_stub->next.load(std::memory_order_relaxed);
+                delete m_stub;
+                m_stub = next;
+            }
         }
 
         void push_back(const T &item) {
-            std::scoped_lock lock(mutex_);
-            deque_.push_back(item);
+            push_back(T(item));
+        }
+
+        void push_back(T &&item) {
+            Node *node = new Node();
+            node->value.emplace(std::move(item));
+            link(node, node, 1);
         }
 
-        void push_front(const T &item) {
-            std::scoped_lock lock(mutex_);
-            deque_.push_front(item);
+        void push_batch(std::vector<T> &&items) {
+            if (items.empty())
+                return;
+            Node *first = nullptr, *last = nullptr;
+            for (T &item: items) {
+                Node *node = new Node();
+                node->value.emplace(std::move(item));
+                if (last)
+                    last->next.store(node, std::memory_order_relaxed);
+                else
+                    first = node;
+                last = node;
+            }
+            link(first, last, items.size());
+            items.clear();
         }
 
+        // A push still being linked in reads as empty until it completes.
         bool empty() {
-            std::scoped_lock lock(mutex_);
-            return deque_.empty();
+            return m_stub->next.load(std::memory_order_acquire) == nullptr;
         }
 
-        size_t size() {
-            std::scoped_lock lock(mutex_);
-            return deque_.size();
+        size_t size() const {
+            return m_size.load(std::memory_order_acquire);
         }
 
-        void clear() {
-            std::scoped_lock lock(mutex_);
-            deque_.clear();
+        // Valid until the next pop, the queue must not be empty.
+        T &front() {
+            return *m_stub->next.load(std::memory_order_acquire)->value;
         }
 
         T pop_front() {
-            std::scoped_lock lock(mutex_);
-            T item = std::move(deque_.front());
-            deque_.pop_front();
+            Node *next = m_stub->next.load(std::memory_order_acquire);
+            T item = std::move(*next->value);
+            next->value.reset();
+            delete m_stub;
+            m_stub = next;
+            m_size.fetch_sub(1, std::memory_order_release);
             return item;
         }
 
-        T pop_back() {
-            std::scoped_lock lock(mutex_);
-            T item = std::move(deque_.back());
-            deque_.pop_back();
-            return item;
+        size_t pop_batch(std::vector<T> &out, size_t max = SIZE_MAX) {
+            size_t count = 0;
+            while (count < max && !empty()) {
+                out.push_back(pop_front());
+                count++;
+            }
+            return count;
+        }
+
+        void clear() {
+            while (!empty())
+                pop_front();
+        }
+
+        template<typename Rep, typename Period>
+        bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+            return m_signal.waitFor(timeout, [this] { return !empty(); });
+        }
+
+        void wait() {
+            m_signal.wait([this] { return !empty(); });
+        }
+
+    private:
+        void link(Node *first, Node *last, size_t count) {
+            m_size.fetch_add(count, std::memory_order_release);
+            Node *prev = m_back.exchange(last, std::memory_order_acq_rel);
+            prev->next.store(first, std::memory_order_release);
+            m_signal.notify();
         }
 
-    protected:
-        std::deque<T> deque_;
-        std::mutex mutex_;
+        // Consumer side, the node before the first unread one.
+        Node *m_stub;
+        std::atomic<Node *> m_back;
+        std::atomic<size_t> m_size = 0;
+        QueueSignal m_signal;
     };
 }
 #endif //NTORRENT_NETLIB_SAFEQUEUE_H
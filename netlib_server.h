@@ -5,6 +5,13 @@
 #include "netlib_message.h"
 #include "netlib_safequeue.h"
 #include "netlib_session.h"
+#include "netlib_multiplexer.h"
+#include "netlib_reuseport.h"
+
+// All sessions share one socket bound to the server port, both peers must use the same mode.
+bool MULTIPLEX_SESSIONS = false;
+// Threads running each shard's io_context, each session's handlers stay serialized on its strand.
+uint16_t IO_THREADS = 1;
 
 namespace netlib {
 
@@ -14,7 +21,13 @@ namespace netlib {
 
         Server(std::string localAddress, uint16_t port, T pingType, T pongType) {
             m_curId = port;
-            m_context = new asio::io_context();
+            m_port = port;
+            m_shards.resize(std::max<uint16_t>(SHARDS, 1));
+            for (Shard &shard: m_shards) {
+                shard.context = new asio::io_context();
+                shard.timers = TimerWheel::create(shard.context);
+            }
+            m_context = m_shards[0].context;
             m_pingType = pingType;
             m_pongType = pongType;
             m_localAddress = std::move(localAddress);
@@ -23,27 +36,40 @@ namespace netlib {
         ~Server() = default;
 
         void start() {
-            m_idleWork = new asio::io_context::work(*m_context);
-            m_contextThread = std::thread([this]() {m_context->run();});
+            for (Shard &shard: m_shards) {
+                shard.idleWork = new asio::io_context::work(*shard.context);
+                for (uint16_t i = 0; i < std::max<uint16_t>(IO_THREADS, 1); i++)
+                    shard.threads.emplace_back([context = shard.context]() {context->run();});
+            }
             std::cout << "[NODE] Started" << "\n";
+            if (MULTIPLEX_SESSIONS)
+                startMultiplexers();
             prepareSession();
         }
 
         void stop() {
-            m_context->stop();
-            if (m_contextThread.joinable()) m_contextThread.join();
-            delete m_idleWork;
+            for (Shard &shard: m_shards)
+                shard.context->stop();
+            for (Shard &shard: m_shards) {
+                for (std::thread &thread: shard.threads)
+                    if (thread.joinable()) thread.join();
+                delete shard.idleWork;
+                delete shard.context;
+            }
 
-            delete m_context;
-            
             std::cout << "[NODE] Stopped\n";
         }
 
         void prepareSession() {
             if (m_sessionsMap.find(m_curId) != m_sessionsMap.end())
                 return;
+            Shard &shard = shardFor(m_curId);
+            if (shard.mux) {
+                m_sessionsMap[m_curId] = std::make_shared<Session<T>>(shard.context, m_queueIn, shard.mux, m_curId, m_pongType, shard.timers);
+                return;
+            }
             std::shared_ptr<Session<T>> newSes =
-                    std::make_shared<Session<T>>(m_context, m_queueIn, asio::ip::udp::socket(*m_context, asio::ip::udp::v4()), m_curId, m_pongType);
+                    std::make_shared<Session<T>>(shard.context, m_queueIn, asio::ip::udp::socket(*shard.context, asio::ip::udp::v4()), m_curId, m_pongType, shard.timers);
             asio::ip::udp::endpoint localEndpoint = asio::ip::udp::endpoint(asio::ip::address_v4::from_string(m_localAddress), m_curId);
             newSes->bindToLocalEndpoint(localEndpoint);
             newSes->startStunSession();
@@ -99,32 +125,68 @@ namespace netlib {
             m_sessionsMap.erase(id);
         }
 
-        void sendMessage(uint16_t id, Message<T> &msg) {
+        void sendMessage(uint16_t id, Message<T> msg) {
             //std:: cout << "sendMessage " << (uint16_t)msg.m_header.id << "\n";
+            sendPayload(id, makePayload(std::move(msg)));
+        }
+
+        void broadcastMessage(const std::vector<uint16_t> &ids, Message<T> msg) {
+            SharedPayload<T> payload = makePayload(std::move(msg));
+            for (uint16_t id: ids)
+                sendPayload(id, payload);
+        }
+
+        void sendPayload(uint16_t id, const SharedPayload<T> &payload) {
             if (m_sessionsMap.find(id) == m_sessionsMap.end()) {
                 std::cout << "There is no such port!\n";
                 return;
             }
             std::shared_ptr<Session<T>> client = m_sessionsMap[id];
             if (client && client->checkAble()) {
-                client->send(msg);
+                client->send(payload);
             }
             else {
                 disconnectClient(id);
             }
         }
 
+        // Blocks until a message is queued or timeout passes, true if update() has work.
+        template<typename Rep, typename Period>
+        bool waitForMessages(std::chrono::duration<Rep, Period> timeout) {
+            return m_queueIn.wait_for(timeout);
+        }
+
         void update() {
-            while (!m_queueIn.empty()) {
-                OwnedMessage<T> msg = m_queueIn.pop_front();
+            m_queueIn.pop_batch(m_inBatch);
+            for (OwnedMessage<T> &msg: m_inBatch)
                 onMessage(msg);
-            }
+            m_inBatch.clear();
+        }
+
+
+        BufferPool &getBufferPool() {
+            return BufferPool::global();
         }
 
+        std::optional<typename Session<T>::Stats> getSessionStats(uint16_t id) {
+            auto it = m_sessionsMap.find(id);
+            if (it == m_sessionsMap.end() || !it->second)
+                return std::nullopt;
+            return it->second->getStats();
+        }
+
+        size_t getMaxBodySize(uint16_t id) {
+            auto it = m_sessionsMap.find(id);
+            if (it == m_sessionsMap.end() || !it->second)
+                return MAX_COALESCED_SIZE - sizeof(MessageHeader<T>) - sizeof(uint64_t) - sizeof(FrameKind);
+            return it->second->maxBodySize();
+        }
 
         asio::ip::udp::endpoint getRealEp() {
             if (m_sessionsMap.find(m_curId) == m_sessionsMap.end())
                 prepareSession();
+            if (m_shards[0].mux)
+                return m_shards[0].mux->getRealEp();
             return m_sessionsMap[m_curId]->getRealEp();
         }
 
@@ -135,19 +197,67 @@ namespace netlib {
 
         };
 
+        // One share-nothing runtime. Session id % shard count picks the shard, which owns the
+        // session's handlers, deadlines and, in multiplexed mode, its socket on the server port.
+        struct Shard {
+            asio::io_context *context = nullptr;
+            asio::io_context::work *idleWork = nullptr;
+            std::vector<std::thread> threads;
+            std::shared_ptr<TimerWheel> timers;
+            std::shared_ptr<Multiplexer<T>> mux;
+        };
+
+        Shard &shardFor(uint16_t id) {
+            return m_shards[id % m_shards.size()];
+        }
+
+        // Every shard binds the server port. The kernel steers datagrams to the owning shard by
+        // their channel id; the rest (first contact, unsteered kernels) travel the ring of shards.
+        void startMultiplexers() {
+            asio::ip::udp::endpoint localEndpoint(asio::ip::address_v4::from_string(m_localAddress), m_port);
+            bool sharded = m_shards.size() > 1;
+            for (size_t i = 0; i < m_shards.size(); i++) {
+                Shard &shard = m_shards[i];
+                shard.mux = std::make_shared<Multiplexer<T>>(shard.context, localEndpoint, shard.timers, sharded);
+                // The primary asks STUN before the others join, so the answer cannot go astray.
+                if (i > 0)
+                    continue;
+                if (sharded && !steerByChannel(shard.mux->socket(), m_shards.size()))
+                    std::cerr << "[NODE] Datagrams are not steered, shards hand them over\n";
+                shard.mux->start(true);
+            }
+            for (size_t i = 0; i < m_shards.size(); i++) {
+                if (sharded) {
+                    m_shards[i].mux->setMissHandler([this, i] (const asio::ip::udp::endpoint &from, std::vector<uint8_t> &&datagram, size_t hops) {
+                        if (hops + 1 >= m_shards.size())
+                            return;
+                        std::shared_ptr<Multiplexer<T>> next = m_shards[(i + 1) % m_shards.size()].mux;
+                        asio::post(next->strand(), [next, from, datagram = std::move(datagram), hops] () {
+                            next->deliver(from, datagram, hops + 1);
+                        });
+                    });
+                }
+                if (i > 0)
+                    m_shards[i].mux->start(false);
+            }
+            m_curId++;
+        }
+
 
     protected:
+        // The first shard's, for work that does not belong to a session.
         asio::io_context *m_context;
-        asio::io_context::work *m_idleWork;
-        std::thread m_contextThread;
+        std::vector<Shard> m_shards;
 
-        SafeQueue<OwnedMessage<T>> m_queueIn;
+        MpscQueue<OwnedMessage<T>> m_queueIn;
+        std::vector<OwnedMessage<T>> m_inBatch;
         std::map<uint16_t, std::shared_ptr<Session<T>>> m_sessionsMap;
 
         uint16_t m_curId = 999;
+        uint16_t m_port = 999;
         std::string m_localAddress = "0.0.0.0";
 
-        SafeQueue<Message<T>> m_eventQueue;
+        MpscQueue<Message<T>> m_eventQueue;
 
         T m_pingType, m_pongType;
     };
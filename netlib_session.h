@@ -2,32 +2,105 @@
 #include "netlib_header.h"
 #include "netlib_message.h"
 #include "netlib_safequeue.h"
+#include "netlib_reorderbuffer.h"
+#include "netlib_batchio.h"
+#include "netlib_uring.h"
+#include "netlib_pmtu.h"
+#include "netlib_fec.h"
+#include "netlib_timerwheel.h"
 #include "netlib_natkiller.h"
 
 std::string STUN_HOST = "stun.l.google.com";
 uint32_t STUN_PORT = 19302;
 
-uint16_t MAX_TIME_OUT = 20;
-uint16_t MAX_NO_ANSWER = 200;
+uint16_t PING_INTERVAL = 3000;
+uint16_t MAX_MISSED_PINGS = 4;
+uint16_t MIN_RTO = 50;
+uint16_t INITIAL_RTO = 1000;
+uint16_t MAX_RTO = 8000;
+uint16_t MAX_BACKOFFS = 6;
+uint16_t WINDOW_SIZE = 64;
+uint16_t RECV_WINDOW_SIZE = 256;
+uint16_t MAX_SACK_RANGES = 8;
 
 uint32_t MAX_PACKET_SIZE = 1 << 15;
+uint32_t MAX_CONTROL_SIZE = 128;
+uint32_t MAX_COALESCED_SIZE = 1200;
+uint16_t FLUSH_DEADLINE = 1;
+uint32_t SOCKET_BUFFER_SIZE = 1 << 22;
 
-uint16_t MAX_PACKET_ID = 17;
+// Fraction of incoming datagrams dropped on purpose, for testing loss recovery.
+double SIMULATED_LOSS = 0;
+
+uint16_t MAX_PACKET_ID = 19;
 
 namespace netlib {
 
+    template<typename T>
+    class Multiplexer;
+
+    // Prefix of every datagram on a shared socket, ids are the sessions' local ids.
+    struct ChannelHeader {
+        uint16_t srcId = 0;
+        uint16_t dstId = 0;
+    };
+
+    // Last byte of every frame. Reliable frames carry a msgId before it.
+    enum class FrameKind : uint8_t {
+        Control,
+        Reliable,
+        Parity,
+    };
+
+    // Large bursts of MTU-sized datagrams overflow the default buffers, the kernel clamps to its maximum.
+    inline void setBufferSizes(asio::ip::udp::socket &socket) {
+        std::error_code ec;
+        socket.set_option(asio::socket_base::receive_buffer_size(SOCKET_BUFFER_SIZE), ec);
+        socket.set_option(asio::socket_base::send_buffer_size(SOCKET_BUFFER_SIZE), ec);
+    }
+
     template<typename T>
     class Session : public std::enable_shared_from_this<Session<T>> {
 
     public:
-        Session(asio::io_context *context, SafeQueue<OwnedMessage<T>> &queueIn, asio::ip::udp::socket &&socket, int id, T pongType) :
-                socket_(std::move(socket)), context_(context), queueIn_(queueIn),
-                stunSession_(STUN_HOST, STUN_PORT, context, socket_), pongType_(pongType), timer(*context_),
-                repeatTimer(*context)  {
+        Session(asio::io_context *context, MpscQueue<OwnedMessage<T>> &queueIn, asio::ip::udp::socket &&socket, int id, T pongType,
+                std::shared_ptr<TimerWheel> timers = nullptr) :
+                socket_(std::move(socket)), context_(context), m_strand(asio::make_strand(*context)),
+                queueIn_(queueIn), pongType_(pongType),
+                m_timers(timers ? std::move(timers) : TimerWheel::create(context)),
+                timer(m_timers, m_strand), repeatTimer(m_timers, m_strand), m_flushTimer(m_timers, m_strand),
+                m_probeTimer(m_timers, m_strand)  {
             id_ = id;
+            stunSession_ = std::make_unique<StunSession>(STUN_HOST, STUN_PORT, context, socket_, m_timers, m_strand);
             is_writing = false;
+            m_pmtu = PmtuProber(maxDatagramSize());
+            setBufferSizes(socket_);
+#ifdef NETLIB_BATCH_IO
+            m_batchIn = BatchReceiver::forSocket(socket_, sizeof(MessageHeader<T>) + MAX_PACKET_SIZE);
+            m_batchOut.setGso(USE_UDP_OFFLOAD && supportsGso(socket_));
+#else
+            m_readBuffer.resize(sizeof(MessageHeader<T>) + MAX_PACKET_SIZE);
+#endif
 
-            m_lastClock = clock();
+            m_lastHeard = std::chrono::steady_clock::now();
+        }
+
+        Session(asio::io_context *context, MpscQueue<OwnedMessage<T>> &queueIn, std::shared_ptr<Multiplexer<T>> mux, int id, T pongType,
+                std::shared_ptr<TimerWheel> timers = nullptr) :
+                socket_(*context), context_(context), m_strand(asio::make_strand(*context)), m_mux(std::move(mux)),
+                queueIn_(queueIn), pongType_(pongType),
+                m_timers(timers ? std::move(timers) : TimerWheel::create(context)),
+                timer(m_timers, m_strand), repeatTimer(m_timers, m_strand), m_flushTimer(m_timers, m_strand),
+                m_probeTimer(m_timers, m_strand)  {
+            id_ = id;
+            is_writing = false;
+            m_muxOpen = true;
+            m_pmtu = PmtuProber(maxDatagramSize());
+#ifdef NETLIB_BATCH_IO
+            m_batchOut.setGso(USE_UDP_OFFLOAD && supportsGso(m_mux->socket()));
+#endif
+
+            m_lastHeard = std::chrono::steady_clock::now();
         }
 
         virtual ~Session() = default;
@@ -38,46 +111,44 @@ namespace netlib {
         };
         SessionType m_type = SessionType::DefaultSession;
 
-        void sendNoAnswer(Message<T> &msg) {
-            msg << false;
-            //std::cout << "sendNoAnswer " << (uint16_t) msg.m_header.id << " " << m_isConnected << " " << getId() << "\n";
-            socket_.send(asio::buffer(&msg.m_header, sizeof(MessageHeader<T>)));
-            socket_.send(asio::buffer(msg.m_body.data(), msg.m_body.size()));
-            bool f;
-            msg >> f;
+        void send(SharedPayload<T> payload) {
+            OutMessage out;
+            out.header = payload->m_header;
+            out.header.size = payload->m_body.size() + sizeof(uint64_t) + sizeof(FrameKind);
+            out.msgId = ++currentId;
+            out.kind = FrameKind::Reliable;
+            out.payload = std::move(payload);
+            queueOut_.push_back(std::move(out));
+            asio::post(m_strand, [this] () { scheduleFlush(); });
         }
 
-        void send(Message<T> &msg) {
-            currentId++;
-            msg << currentId;
-            msg << true;
-            queueOut_.push_back(msg);
-            if (!is_writing && m_isConnected) {
-                writeHeader();
-            }
-            bool f;
-            msg >> f;
-            msg >> currentId;
+        void send(Message<T> &&msg) {
+            send(makePayload(std::move(msg)));
+        }
+
+        void send(const Message<T> &msg) {
+            send(Message<T>(msg));
         }
 
         void disconnect() {
-            if (!socket_.is_open())
+            if (!isConnected())
                 return;
             std::cerr << "Disconnected\n";
-            socket_.close();
+            closeTransport();
         };
 
         void startStunSession() {
-            stunSession_.start();
+            if (stunSession_)
+                stunSession_->start();
         }
 
         void asyncDisconnect() {
             if (isConnected())
-                asio::post(*context_, [this]{socket_.close();});
+                asio::post(m_strand, [self = this->shared_from_this()]{self->closeTransport();});
         }
 
         bool isConnected() const {
-            return socket_.is_open();
+            return m_mux ? m_muxOpen.load() : socket_.is_open();
         }
 
         bool isActive() {
@@ -90,314 +161,904 @@ namespace netlib {
 
         void connectWithEndpoint(asio::ip::udp::endpoint ep, T pingType) {
             pingType_ = pingType;
-            stunSession_.stop();
             remoteEp_ = ep;
-            socket_.async_connect(ep,
-                  [this, pingType] (std::error_code ec) {
-                      if (!ec) {
-                          startListening();
-                          pingCycle();
-                      } else {
-                          std::cerr << ec.message() << "\n";
+            if (m_mux) {
+                m_mux->attach(id_, this->weak_from_this(), ep);
+                asio::post(m_strand, [this] () { pingCycle(); });
+                return;
+            }
+            asio::post(m_strand, [this, ep] () {
+                stunSession_->stop();
+                socket_.async_connect(ep, asio::bind_executor(m_strand,
+                      [this] (std::error_code ec) {
+                          if (!ec) {
+                              startListening();
+                              pingCycle();
+                          } else {
+                              std::cerr << ec.message() << "\n";
+                          }
                       }
-                  }
-            );
+                ));
+            });
         }
 
         asio::ip::udp::endpoint getRealEp() {
-            return stunSession_.getEndpoint();
+            return m_mux ? m_mux->getRealEp() : stunSession_->getEndpoint();
         }
 
         void ping(T pingType) {
-            if (!is_writing) {
-                pingType_ = pingType;
-                Message<T> msg(pingType_);
-                sendNoAnswer(msg);
-                shouldPing = false;
-                return;
-            }
+            pingType_ = pingType;
             shouldPing = true;
+            scheduleFlush();
         }
 
-        void pong(uint64_t msgId) {
-            Message<T> msg(pongType_);
-            msg << msgId;
-            sendNoAnswer(msg);
-            shouldPong = false;
-        }
-
-        void tryPong(uint64_t msgId) {
-            if (!is_writing) {
-                pong(std::max(msgId, m_maxPong));
-                return;
-            }
-            m_maxPong = std::max(msgId, m_maxPong);
-            shouldPong = true;
+        void setWindowSize(uint16_t windowSize) {
+            m_windowSize = std::clamp<uint16_t>(windowSize, 1, RECV_WINDOW_SIZE);
         }
 
         void startListening() {
-            asio::post(*context_,
+            asio::post(m_strand,
                        [this] () {
-                           readHeader();
+                           readMessage();
                        }
             );
         }
 
         asio::basic_socket<asio::ip::udp>::endpoint_type getEndpoint() {
-            return socket_.remote_endpoint();
+            return m_mux ? remoteEp_ : socket_.remote_endpoint();
+        }
+
+        // Entry point for datagrams demultiplexed from a shared socket, runs on strand().
+        void receiveShared(const asio::ip::udp::endpoint &from, uint16_t remoteId, const uint8_t *data, size_t length) {
+            if (!isConnected())
+                return;
+            m_channel.dstId = remoteId;
+            receiveFrom(from, data, length);
+            scheduleFlush();
         }
 
         uint16_t getId() {
             return id_;
         }
 
+        // Serializes everything touching this session's transport state.
+        const asio::strand<asio::io_context::executor_type> &strand() const {
+            return m_strand;
+        }
+
         bool checkAble() {
-            if ((m_isConnected && clock() - m_lastClock > MAX_TIME_OUT * CLOCKS_PER_SEC) || !isConnected())
+            if (!isConnected())
                 return false;
-            return true;
+            if (!m_isConnected)
+                return true;
+            std::scoped_lock lock(mutex_);
+            return m_backoff < MAX_BACKOFFS && std::chrono::steady_clock::now() - m_lastHeard < livenessTimeout();
+        }
+
+        // Largest message body that still fits one datagram on the probed path.
+        size_t maxBodySize() const {
+            // A parity frame wraps a whole frame, leave room for its own header and trailer.
+            size_t parity = USE_FEC ? sizeof(MessageHeader<T>) + FecEncoder::TRAILER_SIZE + sizeof(FrameKind) : 0;
+            return m_pathMtu - channelOverhead() - sizeof(MessageHeader<T>) - sizeof(uint64_t) - sizeof(FrameKind) - parity;
+        }
+
+        struct Stats {
+            std::chrono::microseconds srtt{0};
+            std::chrono::microseconds rttVar{0};
+            std::chrono::microseconds rto{0};
+            std::chrono::microseconds sinceHeard{0};
+            uint64_t retransmits = 0;
+            uint64_t timeouts = 0;
+            uint64_t outOfWindow = 0;
+            size_t inFlight = 0;
+            size_t pathMtu = 0;
+            uint64_t paritySent = 0;
+            uint64_t recovered = 0;
+            double loss = 0;
+        };
+
+        Stats getStats() {
+            std::scoped_lock lock(mutex_);
+            Stats stats = m_stats;
+            stats.rto = currentRto();
+            stats.pathMtu = m_pathMtu;
+            stats.loss = m_loss.loss();
+            stats.sinceHeard = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - m_lastHeard);
+            return stats;
         }
 
     private:
 
+        struct OutMessage {
+            MessageHeader<T> header;
+            SharedPayload<T> payload;
+            uint64_t msgId = 0;
+            FrameKind kind = FrameKind::Control;
+        };
+
+        struct MemMsg {
+            OutMessage msg;
+            std::chrono::steady_clock::time_point time;
+            bool acked = false;
+            bool fastRetransmitted = false;
+            uint16_t retransmits = 0;
+            // Last id of the parity group covering this frame, fast retransmit waits for SACKs past it.
+            uint64_t parityAfter = 0;
+            MemMsg(OutMessage m, std::chrono::steady_clock::time_point t): msg(std::move(m)){
+                time = t;
+            }
+        };
+
+        struct SackRange {
+            uint32_t begin;
+            uint32_t end;
+        };
+
         void endOfWriting() {
-            bool shouldWait;
-            tempMsgOut_ >> shouldWait;
-            uint64_t msgId;
-            tempMsgOut_ >> msgId;
-            tempMsgOut_ << msgId;
-            tempMsgOut_ << shouldWait;
-            //std::cout << "endOfWriting " << (uint16_t)tempMsgOut_.m_header.id << " " << msgId << "\n";
+            //std::cout << "endOfWriting " << m_outFrames.size() << "\n";
             is_writing = false;
-            if (shouldPong)
-                pong(m_maxPong);
-            if (shouldWait) {
-                if (msgId == lastSentId + 1) {
-                    lastSentId++;
-                    m_latestMsg.push_back({tempMsgOut_, (uint64_t)clock()});
+            m_outFrames.clear();
+            scheduleFlush();
+        }
+
+        void requestAck() {
+            shouldPong = true;
+            scheduleFlush();
+        }
+
+        MemMsg *findInFlight(uint64_t msgId) {
+            if (m_latestMsg.empty() || msgId < m_latestMsg.front().msg.msgId)
+                return nullptr;
+            uint64_t pos = msgId - m_latestMsg.front().msg.msgId;
+            if (pos >= m_latestMsg.size())
+                return nullptr;
+            return &m_latestMsg[pos];
+        }
+
+        void onAck(MessageView<T> &view) {
+            uint64_t cumAck;
+            uint32_t probeAck;
+            uint16_t peerRecovered;
+            std::vector<SackRange> ranges;
+            view >> peerRecovered >> probeAck >> cumAck >> ranges;
+            if (!view.ok() || ranges.size() > MAX_SACK_RANGES)
+                return;
+            for (const SackRange &range: ranges) {
+                if (range.begin > range.end)
+                    return;
+            }
+            if (probeAck != 0)
+                onProbeAck(probeAck);
+            //std::cout << "ack: " << cumAck << " ranges: " << ranges.size() << "\n";
+            auto now = std::chrono::steady_clock::now();
+            std::optional<std::chrono::steady_clock::duration> sample;
+            m_lossLost += peerRecovered;
+            auto ackEntry = [this, &sample, now] (MemMsg &mem) {
+                if (!mem.acked) {
+                    if (mem.retransmits == 0)
+                        sample = now - mem.time;
+                    else
+                        m_lossLost++;
+                    m_lossSent++;
+                }
+                mem.acked = true;
+            };
+            for (MemMsg &mem: m_latestMsg) {
+                if (mem.msg.msgId > cumAck)
+                    break;
+                ackEntry(mem);
+            }
+            // Ranges are clamped to what is in flight, ids we never sent must not count as SACKed.
+            if (!m_latestMsg.empty() && cumAck < m_latestMsg.back().msg.msgId) {
+                uint64_t first = m_latestMsg.front().msg.msgId;
+                uint64_t last = m_latestMsg.back().msg.msgId;
+                for (const SackRange &range: ranges) {
+                    uint64_t end = std::min<uint64_t>(cumAck + range.end, last);
+                    for (uint64_t id = std::max<uint64_t>(cumAck + range.begin, first); id <= end; id++) {
+                        ackEntry(*findInFlight(id));
+                        m_highestSacked = std::max(m_highestSacked, id);
+                    }
+                }
+            }
+            uint64_t oldFront = m_latestMsg.empty() ? 0 : m_latestMsg.front().msg.msgId;
+            while (!m_latestMsg.empty() && m_latestMsg.front().acked) {
+                m_latestMsg.pop_front();
+            }
+            for (MemMsg &mem: m_latestMsg) {
+                if (mem.msg.msgId >= m_highestSacked)
+                    break;
+                if (!mem.acked && !mem.fastRetransmitted && mem.parityAfter < m_highestSacked) {
+                    mem.fastRetransmitted = true;
+                    m_retransmitIds.push_back(mem.msg.msgId);
                 }
+            }
+            {
+                std::scoped_lock lock(mutex_);
+                if (m_lossSent >= 4 * FEC_GROUP_SIZE) {
+                    m_loss.onSample(m_lossSent, m_lossLost);
+                    m_lossSent = m_lossLost = 0;
+                }
+                if (sample)
+                    updateRtt(std::chrono::duration_cast<std::chrono::microseconds>(*sample));
+                // Progress means the peer is alive even when every acked frame was a retransmit (Karn).
+                if (sample || m_latestMsg.empty() || m_latestMsg.front().msg.msgId != oldFront)
+                    m_backoff = 0;
+                m_stats.inFlight = m_latestMsg.size();
+            }
+            if (m_latestMsg.empty() || m_latestMsg.front().msg.msgId != oldFront)
+                armRetransmitTimer();
+        }
+
+        void updateRtt(std::chrono::microseconds sample) {
+            if (!m_hasRtt) {
+                m_stats.srtt = sample;
+                m_stats.rttVar = sample / 2;
+                m_hasRtt = true;
             } else {
-                if (shouldPing)
-                    ping(pingType_);
-                if (!queueOut_.empty() && m_isConnected)
-                    writeHeader();
+                std::chrono::microseconds delta = m_stats.srtt > sample ? m_stats.srtt - sample : sample - m_stats.srtt;
+                m_stats.rttVar = (3 * m_stats.rttVar + delta) / 4;
+                m_stats.srtt = (7 * m_stats.srtt + sample) / 8;
+            }
+            m_rto = m_stats.srtt + std::max<std::chrono::microseconds>(std::chrono::milliseconds(1), 4 * m_stats.rttVar);
+            m_rto = std::clamp<std::chrono::microseconds>(m_rto, std::chrono::milliseconds(MIN_RTO),
+                                                          std::chrono::milliseconds(MAX_RTO));
+        }
+
+        std::chrono::microseconds currentRto() const {
+            std::chrono::microseconds rto = m_rto * (1 << std::min<uint16_t>(m_backoff, 16));
+            return std::min<std::chrono::microseconds>(rto, std::chrono::milliseconds(MAX_RTO));
+        }
+
+        std::chrono::steady_clock::duration livenessTimeout() const {
+            return std::chrono::milliseconds(PING_INTERVAL * MAX_MISSED_PINGS) + 4 * currentRto();
+        }
+
+        void armRetransmitTimer() {
+            if (m_latestMsg.empty()) {
+                repeatTimer.cancel();
+                return;
+            }
+            std::chrono::microseconds rto;
+            {
+                std::scoped_lock lock(mutex_);
+                rto = currentRto();
             }
+            repeatTimer.startAt(m_latestMsg.front().time + rto, [this] () { onRetransmitTimeout(); });
+        }
+
+        void onRetransmitTimeout() {
+            if (!m_isConnected || !isConnected() || m_latestMsg.empty())
+                return;
+            {
+                std::scoped_lock lock(mutex_);
+                m_backoff++;
+                m_stats.timeouts++;
+            }
+            if (m_backoff == PMTU_MAX_PROBES && m_pmtu.confirmed() > PMTU_BASE) {
+                // Possible black hole after a path change, fall back to the base size and search again.
+                m_pmtu.reset();
+                m_pathMtu = m_pmtu.confirmed();
+                probePathMtu();
+            }
+            //std::cout << "timeout, rto " << currentRto().count() << "\n";
+            for (MemMsg &mem: m_latestMsg) {
+                if (mem.msg.msgId > m_highestSacked && mem.msg.msgId != m_latestMsg.front().msg.msgId)
+                    break;
+                if (!mem.acked)
+                    m_retransmitIds.push_back(mem.msg.msgId);
+            }
+            m_latestMsg.front().time = std::chrono::steady_clock::now();
+            scheduleFlush();
+            armRetransmitTimer();
         }
 
         void endOfReading() {
-            bool shouldAnswer;
-            tempMsgIn_ >> shouldAnswer;
+            FrameKind kind;
+            uint64_t msgId = 0;
+            MessageView<T> view(tempMsgIn_);
+            view >> kind;
+            if (view.ok() && kind == FrameKind::Parity) {
+                onParity(view);
+                return;
+            }
+            bool shouldAnswer = kind == FrameKind::Reliable;
+            if (tempMsgIn_.m_header.id == pongType_) {
+                onAck(view);
+            } else if (tempMsgIn_.m_header.id != pingType_) {
+                view >> msgId;
+            } else if (view.remaining() >= sizeof(uint32_t)) {
+                view >> m_probeAck;
+                requestAck();
+            }
+            if (!view.ok())
+                return;
             //std::cout << "endOfReading " << (uint16_t)tempMsgIn_.m_header.id << " " << tempMsgIn_.m_header.size << "\n";
-            m_lastClock = clock();
             if (!m_isConnected) {
-                checkRepeat();
+                m_isConnected = true;
+                probePathMtu();
             }
-            m_isConnected = true;
-            if (tempMsgIn_.m_header.id == pongType_) {
-                uint64_t pongMsgId;
-                tempMsgIn_ >> pongMsgId;
-                //std::cout << "pongId: " << pongMsgId << "\n";
-                while (pongMsgId + m_latestMsg.size() > lastSentId) {
-                    m_latestMsg.pop_front();
+            if (tempMsgIn_.m_header.id == pongType_ || tempMsgIn_.m_header.id == pingType_)
+                return;
+            tempMsgIn_.m_body.resize(view.remaining());
+            tempMsgIn_.m_header.size = tempMsgIn_.m_body.size();
+            //std::cout << "msgId: " << msgId << "\n";
+            if (shouldAnswer)
+                requestAck();
+            if (msgId > m_reorder.delivered() && !m_reorder.inWindow(msgId)) {
+                std::scoped_lock lock(mutex_);
+                m_stats.outOfWindow++;
+            } else if (m_reorder.insert(msgId, std::move(tempMsgIn_))) {
+                m_reorder.drain([this] (Message<T> &&msg) {
+                    queueIn_.push_back({this->shared_from_this(), std::move(msg)});
+                });
+            }
+            tempMsgIn_.clear();
+        }
+
+        static size_t frameSize(const OutMessage &out) {
+            return sizeof(MessageHeader<T>) + out.header.size;
+        }
+
+        static void appendFrame(std::vector<asio::const_buffer> &buffers, const OutMessage &out) {
+            buffers.push_back(asio::buffer(&out.header, sizeof(MessageHeader<T>)));
+            buffers.push_back(asio::buffer(out.payload->m_body.data(), out.payload->m_body.size()));
+            if (out.kind == FrameKind::Reliable)
+                buffers.push_back(asio::buffer(&out.msgId, sizeof(uint64_t)));
+            buffers.push_back(asio::buffer(&out.kind, sizeof(FrameKind)));
+        }
+
+        // Adds a first transmission to the current parity group, starting one if loss warrants it.
+        void encodeParity(const OutMessage &out) {
+            if (!m_fec.active()) {
+                uint16_t parity = USE_FEC ? m_loss.parityCount(FEC_GROUP_SIZE) : 0;
+                if (parity == 0)
+                    return;
+                m_fec.begin(out.msgId, parity);
+            }
+            m_fecFrame.clear();
+            appendFrame(m_fecFrame, out);
+            m_fec.add(m_fecFrame);
+            m_latestMsg.back().parityAfter = UINT64_MAX;
+            if (m_fec.count() == FEC_GROUP_SIZE)
+                emitParity();
+        }
+
+        void emitParity() {
+            for (uint16_t cls = 0; cls < m_fec.stride() && cls < m_fec.count(); cls++) {
+                Message<T> msg(pingType_);
+                msg.writeBytes(std::span<const uint8_t>(m_fec.parity(cls)));
+                msg << m_fec.xorLength(cls) << m_fec.firstId() << m_fec.count() << m_fec.stride() << cls;
+                OutMessage out;
+                out.header = msg.m_header;
+                out.header.size = msg.m_body.size() + sizeof(FrameKind);
+                out.kind = FrameKind::Parity;
+                out.payload = makePayload(std::move(msg));
+                m_parityOut.push_back(std::move(out));
+            }
+            uint64_t lastId = m_fec.firstId() + m_fec.count() - 1;
+            for (auto it = m_latestMsg.rbegin(); it != m_latestMsg.rend() && it->msg.msgId >= m_fec.firstId(); it++)
+                it->parityAfter = lastId;
+            std::scoped_lock lock(mutex_);
+            m_stats.paritySent += std::min(m_fec.stride(), m_fec.count());
+            m_fec.begin(0, 0);
+        }
+
+        // Rebuilds the single missing frame of a parity class from the cached others.
+        void onParity(MessageView<T> &view) {
+            uint16_t cls, stride, count;
+            uint64_t firstId;
+            uint32_t xorLength;
+            view >> cls >> stride >> count >> firstId >> xorLength;
+            if (!view.ok() || stride == 0 || cls >= stride)
+                return;
+            if (!m_fecCache) {
+                m_fecCache = std::make_unique<FecCache>(FEC_CACHE_SIZE);
+                return;
+            }
+            std::vector<uint64_t> others;
+            uint64_t missing = 0;
+            for (uint64_t id = firstId + cls; id < firstId + count; id += stride) {
+                if (id <= m_reorder.delivered() || m_reorder.contains(id)) {
+                    others.push_back(id);
+                } else if (missing == 0) {
+                    missing = id;
+                } else {
+                    return;
                 }
             }
-            else {
-                if (tempMsgIn_.m_header.id != pingType_) {
-                    uint64_t msgId;
-                    tempMsgIn_ >> msgId;
-                    //std::cout << "msgId: " << msgId << "\n";
-                    if (shouldAnswer && msgId <= lastGotId + 1) {
-                        tryPong(msgId);
-                    }
-                    if (msgId >= lastGotId + 1) {
-                        m_futureMsgMap[msgId] = tempMsgIn_;
-                    } else {
-                        //std::cout << "! skipped message\n";
-                    }
-                    uint16_t delta = 0;
-                    while (m_futureMsgMap.find(lastGotId + 1) != m_futureMsgMap.end()) {
-                        queueIn_.push_back({this->shared_from_this(), m_futureMsgMap[lastGotId + 1]});
-                        m_futureMsgMap.erase(lastGotId + 1);
-                        lastGotId++;
-                        delta++;
-                    }
-                    if (delta > 1)
-                        tryPong(lastGotId);
+            if (missing == 0 || !m_reorder.inWindow(missing))
+                return;
+            std::vector<uint8_t> frame(tempMsgIn_.m_body.data(), tempMsgIn_.m_body.data() + view.remaining());
+            if (!m_fecCache->recover(others, frame, xorLength))
+                return;
+            size_t offset = 0;
+            if (frame.size() < sizeof(uint64_t) + sizeof(FrameKind) || !parseFrame(frame.data(), offset, frame.size()) ||
+                    offset != frame.size() || frame.back() != (uint8_t)FrameKind::Reliable)
+                return;
+            uint64_t msgId;
+            std::memcpy(&msgId, frame.data() + frame.size() - sizeof(FrameKind) - sizeof(uint64_t), sizeof(uint64_t));
+            if (msgId != missing)
+                return;
+            //std::cout << "recovered " << msgId << "\n";
+            m_recovered++;
+            {
+                std::scoped_lock lock(mutex_);
+                m_stats.recovered++;
+            }
+            endOfReading();
+        }
+
+        std::vector<SackRange> sackRanges() {
+            std::vector<SackRange> ranges;
+            m_reorder.forEachPending([this, &ranges] (uint64_t msgId) {
+                uint32_t offset = msgId - m_reorder.delivered();
+                if (!ranges.empty() && ranges.back().end + 1 == offset) {
+                    ranges.back().end = offset;
+                } else {
+                    if (ranges.size() == MAX_SACK_RANGES)
+                        return false;
+                    ranges.push_back({offset, offset});
                 }
+                return true;
+            });
+            return ranges;
+        }
+
+        OutMessage controlFrame(T type) {
+            Message<T> msg(type);
+            if (type == pongType_) {
+                msg << sackRanges() << m_reorder.delivered() << m_probeAck << m_recovered;
+                m_probeAck = 0;
+                m_recovered = 0;
             }
-            tempMsgIn_.clear();
-            if (!is_writing) {
-                if (shouldPong)
-                    pong(m_maxPong);
+            OutMessage out;
+            out.header = msg.m_header;
+            out.header.size = msg.m_body.size() + sizeof(FrameKind);
+            out.payload = makePayload(std::move(msg));
+            return out;
+        }
+
+        size_t channelOverhead() const {
+            return m_mux ? sizeof(ChannelHeader) : 0;
+        }
+
+        size_t maxDatagramSize() const {
+            return std::min<size_t>(65507, channelOverhead() + sizeof(MessageHeader<T>) + MAX_PACKET_SIZE);
+        }
+
+        size_t coalesceLimit() const {
+            return std::max<size_t>(MAX_COALESCED_SIZE, m_pathMtu) - channelOverhead();
+        }
+
+        // Probes are padded pings sent with DF set, the peer echoes their size in its next pong.
+        void probePathMtu() {
+            if (!isConnected())
+                return;
+            if (m_pmtu.probeSize() != 0)
+                m_pmtu.onLost();
+            size_t size = m_pmtu.nextProbe();
+            if (size != 0 && !sendProbe(size))
+                return;
+            m_pathMtu = m_pmtu.confirmed();
+            std::chrono::steady_clock::duration wait = 2 * currentRto();
+            if (size == 0)
+                wait = std::chrono::milliseconds(PMTU_RAISE_INTERVAL);
+            m_probeTimer.start(wait, [this] () {
+                if (!m_pmtu.searching())
+                    m_pmtu.raise();
+                probePathMtu();
+            });
+        }
+
+        void onProbeAck(uint32_t size) {
+            bool current = size == m_pmtu.probeSize();
+            m_pmtu.onAck(size);
+            m_pathMtu = m_pmtu.confirmed();
+            if (current)
+                probePathMtu();
+        }
+
+        bool sendProbe(size_t size) {
+            if (!DONT_FRAGMENT_SUPPORTED)
+                return false;
+            std::vector<uint8_t> probe(size, 0);
+            MessageHeader<T> header;
+            header.id = pingType_;
+            header.size = size - channelOverhead() - sizeof(MessageHeader<T>);
+            uint32_t probeSize = size;
+            m_channel.srcId = id_;
+            if (m_mux)
+                std::memcpy(probe.data(), &m_channel, sizeof(ChannelHeader));
+            std::memcpy(probe.data() + channelOverhead(), &header, sizeof(header));
+            std::memcpy(probe.data() + size - sizeof(FrameKind) - sizeof(uint32_t), &probeSize, sizeof(uint32_t));
+            // DF is a socket option, on a shared socket it must not leak into other sessions' sends.
+            asio::dispatch(sendExecutor(), [this, probe = std::move(probe), ep = remoteEp_] () {
+                asio::ip::udp::socket &socket = m_mux ? m_mux->socket() : socket_;
+                if (!setDontFragment(socket, true))
+                    return;
+                std::error_code ec;
+                if (m_mux)
+                    socket.send_to(asio::buffer(probe), ep, 0, ec);
+                else
+                    socket.send(asio::buffer(probe), 0, ec);
+                setDontFragment(socket, false);
+                //std::cout << "probe " << probe.size() << " " << ec.message() << "\n";
+                if (ec == asio::error::message_size) {
+                    asio::dispatch(m_strand, [this, size = probe.size()] () {
+                        if (size == m_pmtu.probeSize())
+                            m_pmtu.onTooBig();
+                    });
+                }
+            });
+            return true;
+        }
+
+        // A shared socket is owned by the multiplexer's strand, sends on it are handed over there.
+        asio::any_io_executor sendExecutor() const {
+            if (m_mux)
+                return m_mux->strand();
+            return m_strand;
+        }
+
+        bool canSendNew() {
+            return m_isConnected && !queueOut_.empty() && m_latestMsg.size() < m_windowSize;
+        }
+
+        void scheduleFlush() {
+            if (is_writing)
+                return;
+            if (!m_retransmitIds.empty() || !m_parityOut.empty() || (canSendNew() && frameSize(queueOut_.front()) > MAX_CONTROL_SIZE)) {
+                flush();
+                return;
             }
-            if (!is_writing && !queueOut_.empty())
-                writeHeader();
-            readHeader();
+            if (m_flushTimer.armed())
+                return;
+            m_flushTimer.start(std::chrono::milliseconds(FLUSH_DEADLINE), [this] () { flush(); });
         }
 
-        void writeHeader() {
+        // Appends the frames of one datagram to m_outFrames, returns false if there was nothing to send.
+        bool fillDatagram(uint64_t &retransmitted) {
+            size_t first = m_outFrames.size();
+            if (shouldPong)
+                m_outFrames.push_back(controlFrame(pongType_));
+            if (shouldPing)
+                m_outFrames.push_back(controlFrame(pingType_));
+            shouldPong = shouldPing = false;
+            size_t size = 0;
+            bool hasReliable = false;
+            for (size_t i = first; i < m_outFrames.size(); i++)
+                size += frameSize(m_outFrames[i]);
+            // Every frame takes up to four gather buffers, the channel header one more.
+            auto fits = [&] (size_t next) {
+                return !hasReliable || (size + next <= coalesceLimit() &&
+                                        (m_outFrames.size() - first + 1) * 4 + 1 <= MAX_DATAGRAM_BUFFERS);
+            };
+            while (!m_parityOut.empty()) {
+                if (!fits(frameSize(m_parityOut.front())))
+                    break;
+                size += frameSize(m_parityOut.front());
+                m_outFrames.push_back(std::move(m_parityOut.front()));
+                m_parityOut.pop_front();
+                hasReliable = true;
+            }
+            while (m_isConnected && !m_retransmitIds.empty()) {
+                MemMsg *mem = findInFlight(m_retransmitIds.front());
+                if (!mem || mem->acked) {
+                    m_retransmitIds.pop_front();
+                    continue;
+                }
+                if (!fits(frameSize(mem->msg)))
+                    break;
+                m_retransmitIds.pop_front();
+                mem->time = std::chrono::steady_clock::now();
+                mem->retransmits++;
+                retransmitted++;
+                m_outFrames.push_back(mem->msg);
+                size += frameSize(mem->msg);
+                hasReliable = true;
+            }
+            while (canSendNew() && m_retransmitIds.empty()) {
+                size_t next = frameSize(queueOut_.front());
+                if (!fits(next))
+                    break;
+                m_outFrames.push_back(queueOut_.pop_front());
+                m_latestMsg.push_back({m_outFrames.back(), std::chrono::steady_clock::now()});
+                encodeParity(m_outFrames.back());
+                if (m_latestMsg.size() == 1)
+                    armRetransmitTimer();
+                size += next;
+                hasReliable = true;
+            }
+            return m_outFrames.size() > first;
+        }
+
+        void flush() {
+            if (is_writing || !isConnected())
+                return;
+            uint64_t retransmitted = 0;
+            std::vector<size_t> frameEnds;
+#ifdef NETLIB_BATCH_IO
+            // With GSO a whole run of segments costs the kernel one entry, so a flush may fill a super-buffer.
+            size_t maxDatagrams = m_batchOut.hasGso() ? std::max<size_t>(BATCH_SIZE, MAX_GSO_SEGMENTS) : BATCH_SIZE;
+#else
+            size_t maxDatagrams = 1;
+#endif
+            while (frameEnds.size() < maxDatagrams && fillDatagram(retransmitted))
+                frameEnds.push_back(m_outFrames.size());
+            if (m_fec.active() && queueOut_.empty())
+                emitParity();
+            {
+                std::scoped_lock lock(mutex_);
+                m_stats.retransmits += retransmitted;
+                m_stats.inFlight = m_latestMsg.size();
+            }
+            if (m_outFrames.empty())
+                return;
+            m_outBuffers.clear();
+            m_datagramEnds.clear();
+            m_sendChannel = m_channel;
+            m_sendChannel.srcId = id_;
+            m_sendEp = remoteEp_;
+#ifdef NETLIB_BATCH_IO
+            m_batchOut.setSegmentLimit(m_pathMtu);
+#endif
+            size_t frame = 0;
+            for (size_t frameEnd: frameEnds) {
+                if (m_mux)
+                    m_outBuffers.push_back(asio::buffer(&m_sendChannel, sizeof(ChannelHeader)));
+                for (; frame < frameEnd; frame++)
+                    appendFrame(m_outBuffers, m_outFrames[frame]);
+                m_datagramEnds.push_back(m_outBuffers.size());
+            }
             is_writing = true;
-            tempMsgOut_ = queueOut_.pop_front();
-            //std::cout << "writeHeader " << (uint16_t )tempMsgOut_.m_header.id << " " << tempMsgOut_.m_body.size() << "\n";
-            socket_.async_send(asio::buffer(&tempMsgOut_.m_header, sizeof(MessageHeader<T>)),
-                               [this] (std::error_code er, size_t length) {
-                                   if (!er) {
-                                       if (tempMsgOut_.m_body.size() > 0) {
-                                           writeBody();
-                                       }
-                                       else {
-                                           endOfWriting();
-                                       }
-                                   }
-                                   else {
-                                       disconnect();
-                                   }
-                               }
-            );
+            //std::cout << "flush " << m_outFrames.size() << " " << frameEnds.size() << "\n";
+#ifdef NETLIB_BATCH_IO
+            asio::dispatch(sendExecutor(), [this] () { sendBatch(0); });
+#else
+            auto onSent = asio::bind_executor(m_strand, [this] (std::error_code er, size_t length) {
+                if (!er) {
+                    endOfWriting();
+                }
+                else {
+                    disconnect();
+                }
+            });
+            if (m_mux)
+                asio::dispatch(m_mux->strand(), [this, onSent] () mutable {
+                    m_mux->socket().async_send_to(m_outBuffers, m_sendEp, std::move(onSent));
+                });
+            else
+                socket_.async_send(m_outBuffers, onSent);
+#endif
+        }
+
+#ifdef NETLIB_BATCH_IO
+        // Runs on sendExecutor(), hands the outcome back to the session's strand.
+        void sendBatch(size_t first) {
+#ifdef NETLIB_IO_URING
+            if (m_mux && m_mux->ring()) {
+                sendRing();
+                return;
+            }
+#endif
+            asio::ip::udp::socket &socket = m_mux ? m_mux->socket() : socket_;
+            int sent = m_batchOut.send(socket, m_mux ? &m_sendEp : nullptr, m_outBuffers, m_datagramEnds, first);
+            if (sent < 0) {
+                asio::post(m_strand, [this] () { disconnect(); });
+                return;
+            }
+            first += sent;
+            if (first == m_datagramEnds.size()) {
+                asio::post(m_strand, [this] () { endOfWriting(); });
+                return;
+            }
+            socket.async_wait(asio::ip::udp::socket::wait_write, asio::bind_executor(sendExecutor(),
+                              [this, first] (std::error_code er) {
+                                  if (!er)
+                                      sendBatch(first);
+                                  else
+                                      asio::post(m_strand, [this] () { disconnect(); });
+                              }
+            ));
+        }
+#endif
+
+#ifdef NETLIB_IO_URING
+        // Runs on the multiplexer's strand. The ring waits out a full socket buffer by itself.
+        void sendRing() {
+            std::vector<mmsghdr> &headers = m_batchOut.prepare(&m_sendEp, m_outBuffers, m_datagramEnds, 0);
+            m_mux->ring()->sendmsg(m_mux->socket().native_handle(), headers, [this] (int error) {
+                if (error == 0) {
+                    asio::post(m_strand, [this] () { endOfWriting(); });
+                } else if ((error == EIO || error == EINVAL) && m_batchOut.hasGso()) {
+                    m_batchOut.setGso(false);
+                    sendRing();
+                } else {
+                    asio::post(m_strand, [this] () { disconnect(); });
+                }
+            });
+        }
+#endif
+
+        void closeTransport() {
+            timer.cancel();
+            m_probeTimer.cancel();
+            repeatTimer.cancel();
+            m_flushTimer.cancel();
+            if (!m_mux) {
+                socket_.close();
+                return;
+            }
+            m_muxOpen = false;
+            m_mux->detach(id_);
+        }
+
+        bool parseFrame(const uint8_t *data, size_t &offset, size_t length) {
+            if (length - offset < sizeof(MessageHeader<T>))
+                return false;
+            std::memcpy(&tempMsgIn_.m_header, data + offset, sizeof(MessageHeader<T>));
+            size_t bodyBegin = offset + sizeof(MessageHeader<T>);
+            if (tempMsgIn_.m_header.size > MAX_PACKET_SIZE ||
+                    tempMsgIn_.m_header.size > length - bodyBegin ||
+                    (uint16_t)tempMsgIn_.m_header.id > MAX_PACKET_ID)
+                return false;
+            offset = bodyBegin + tempMsgIn_.m_header.size;
+            tempMsgIn_.m_body.assign(data + bodyBegin, data + offset);
+            return true;
+        }
+
+        void processDatagram(const uint8_t *data, size_t length) {
+            {
+                std::scoped_lock lock(mutex_);
+                m_lastHeard = std::chrono::steady_clock::now();
+            }
+            size_t offset = 0, frameBegin = 0;
+            while (parseFrame(data, offset, length)) {
+                //std::cout << "readMessage " << (uint16_t)tempMsgIn_.m_header.id << " " << tempMsgIn_.m_header.size << "\n";
+                if (m_fecCache && offset - frameBegin >= sizeof(uint64_t) + sizeof(FrameKind) &&
+                        data[offset - 1] == (uint8_t)FrameKind::Reliable) {
+                    uint64_t msgId;
+                    std::memcpy(&msgId, data + offset - sizeof(FrameKind) - sizeof(uint64_t), sizeof(uint64_t));
+                    m_fecCache->store(msgId, data + frameBegin, offset - frameBegin);
+                }
+                frameBegin = offset;
+                endOfReading();
+            }
+        }
+
+        void receiveFrom(const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length) {
+            if (SIMULATED_LOSS > 0 && std::uniform_real_distribution<double>(0, 1)(m_lossShim) < SIMULATED_LOSS)
+                return;
+            if (!m_isConnected && from.address() == remoteEp_.address())
+                remoteEp_ = from;
+            if (from != remoteEp_)
+                return;
+            processDatagram(data, length);
         }
 
-        void writeBody() {
-            //std::cout << "writeBody " << (uint16_t )tempMsgOut_.m_header.id << " " << tempMsgOut_.m_body.size() << "\n";
-            socket_.async_send(asio::buffer(tempMsgOut_.m_body.data(), tempMsgOut_.m_body.size()),
-                               [this] (std::error_code er, size_t length) {
-                                   if (!er) {
-                                       endOfWriting();
+        void readMessage() {
+#ifdef NETLIB_BATCH_IO
+            socket_.async_wait(asio::ip::udp::socket::wait_read, asio::bind_executor(m_strand,
+                               [this] (std::error_code er) {
+                                   if (er) {
+                                       disconnect();
+                                       return;
                                    }
-                                   else {
+                                   int count = m_batchIn->receive(socket_,
+                                           [this] (const asio::ip::udp::endpoint &from, const uint8_t *data, size_t length) {
+                                               receiveFrom(from, data, length);
+                                           });
+                                   if (count < 0) {
                                        disconnect();
+                                       return;
                                    }
+                                   scheduleFlush();
+                                   readMessage();
                                }
-            );
-        }
-
-        void readHeader() {
-            socket_.async_receive_from(asio::buffer(&tempMsgIn_.m_header, sizeof(MessageHeader<T>)), tempEp_,
+            ));
+#else
+            socket_.async_receive_from(asio::buffer(m_readBuffer.data(), m_readBuffer.size()), tempEp_, asio::bind_executor(m_strand,
                                   [this] (std::error_code er, size_t length) {
-                                      if (!er) {
-                                          if (!m_isConnected && tempEp_.address() == remoteEp_.address())
-                                              remoteEp_ = tempEp_;
-                                          if (tempEp_ != remoteEp_) {
-                                              readHeader();
-                                              return;
-                                          }
-                                          if (length != sizeof(MessageHeader<T>) ||
-                                                tempMsgIn_.m_header.size > MAX_PACKET_SIZE ||
-                                                  (uint16_t)tempMsgIn_.m_header.id > MAX_PACKET_ID) {
-                                              readHeader();
-                                              return;
-                                          }
-                                          //std::cout << "readHeader " << (uint16_t)tempMsgIn_.m_header.id << " " << tempMsgIn_.m_header.size << "\n";
-                                          if (tempMsgIn_.m_header.size > 0) {
-                                              tempMsgIn_.m_body.resize(tempMsgIn_.m_header.size);
-                                              readBody();
-                                          }
-                                          else {
-                                              endOfReading();
-                                          }
-                                      }
-                                      else {
-                                          disconnect();
+                                      if (er == asio::error::message_size) {
+                                          readMessage();
+                                          return;
                                       }
-                                  }
-            );
-        }
-
-        void readBody() {
-            socket_.async_receive_from(asio::buffer(tempMsgIn_.m_body.data(), tempMsgIn_.m_body.size()), tempEp_,
-                                  [this] (std::error_code er, size_t length) {
                                       if (!er) {
-                                          if (tempEp_ != remoteEp_) {
-                                              readBody();
-                                              return;
-                                          }
-                                          if (length != tempMsgIn_.m_body.size()) {
-                                              //std::cout << length << " <- not ness " << (uint16_t)tempMsgIn_.m_header.id << "\n";
-                                              readHeader();
-                                              return;
-                                          }
-                                          endOfReading();
+                                          receiveFrom(tempEp_, m_readBuffer.data(), length);
+                                          scheduleFlush();
+                                          readMessage();
                                       }
                                       else {
                                           disconnect();
                                       }
                                   }
-            );
-        }
-
-        void checkRepeat() {
-            repeatTimer.expires_after(std::chrono::milliseconds(MAX_NO_ANSWER));
-            repeatTimer.async_wait(
-                    [this](std::error_code ec) {
-                        if (m_isConnected && !m_latestMsg.empty() && clock() > MAX_NO_ANSWER + m_latestMsg.front().time) {
-                            m_latestMsg.front().time = clock();
-                            queueOut_.push_front(m_latestMsg.front().msg);
-                        }
-                        checkRepeat();
-            });
+            ));
+#endif
         }
 
         void pingCycle() {
-            timer.expires_after(std::chrono::milliseconds(3000));
-            timer.async_wait(
-                    [this](std::error_code ec) {
-                        if (!ec) {
-                            if (!checkAble()) {
-                                disconnect();
-                                return;
-                            }
-                            if (queueOut_.empty() || !m_isConnected)
-                                ping(pingType_);
-                            if (!is_writing)
-                                checkRepeat();
-                            pingCycle();
-                        } else {
-                            std::cerr << "Waiting error: " << ec.message() << "\n";
-                        }
-                    }
-            );
-        };
-
-        struct MemMsg {
-            Message<T> msg;
-            uint64_t time;
-            MemMsg(Message<T> m, uint64_t t): msg(m){
-                time = t;
-            }
+            timer.start(std::chrono::milliseconds(PING_INTERVAL), [this] () {
+                if (!checkAble()) {
+                    disconnect();
+                    return;
+                }
+                if (queueOut_.empty() || !m_isConnected)
+                    ping(pingType_);
+                pingCycle();
+            });
         };
 
     private:
         asio::ip::udp::socket socket_;
         asio::io_context *context_;
-        StunSession stunSession_;
-        SafeQueue<Message<T>> queueOut_;
-        Message<T> tempMsgOut_;
-        SafeQueue<OwnedMessage<T>> &queueIn_;
+        asio::strand<asio::io_context::executor_type> m_strand;
+        std::unique_ptr<StunSession> stunSession_;
+        std::shared_ptr<Multiplexer<T>> m_mux;
+        std::atomic<bool> m_muxOpen = false;
+        ChannelHeader m_channel;
+        // Copies the send in progress reads, the originals keep changing on the strand.
+        ChannelHeader m_sendChannel;
+        asio::ip::udp::endpoint m_sendEp;
+        // Filled by whichever thread calls send(), one at a time, drained by the io handlers.
+        SpscQueue<OutMessage> queueOut_;
+        std::vector<OutMessage> m_outFrames;
+        std::vector<asio::const_buffer> m_outBuffers;
+        std::vector<size_t> m_datagramEnds;
+#ifdef NETLIB_BATCH_IO
+        std::unique_ptr<BatchReceiver> m_batchIn;
+        BatchSender m_batchOut;
+#endif
+        MpscQueue<OwnedMessage<T>> &queueIn_;
         Message<T> tempMsgIn_;
+        std::vector<uint8_t> m_readBuffer;
 
-        SafeQueue<MemMsg> m_latestMsg;
-        uint64_t lastSentId = 0;
-        uint64_t lastGotId = 0;
+        std::deque<MemMsg> m_latestMsg;
+        std::deque<uint64_t> m_retransmitIds;
+        uint64_t m_highestSacked = 0;
+        uint16_t m_windowSize = WINDOW_SIZE;
         uint64_t currentId = 0;
 
         std::mutex mutex_;
         bool is_writing = false;
 
         bool shouldPong = false;
-        uint64_t m_maxPong = 0;
         bool shouldPing = false;
 
         uint16_t id_;
 
         T pongType_, pingType_;
 
-        asio::steady_timer timer;
-        asio::steady_timer repeatTimer;
+        std::shared_ptr<TimerWheel> m_timers;
+        TimerWheel::Timer timer;
+        TimerWheel::Timer repeatTimer;
+        TimerWheel::Timer m_flushTimer;
+        TimerWheel::Timer m_probeTimer;
 
-        bool m_isConnected = false;
-        std::clock_t m_lastClock = 0;
+        std::atomic<bool> m_isConnected = false;
+        std::chrono::steady_clock::time_point m_lastHeard;
+        Stats m_stats;
+        bool m_hasRtt = false;
+        std::chrono::microseconds m_rto = std::chrono::milliseconds(INITIAL_RTO);
+        uint16_t m_backoff = 0;
 
         asio::ip::udp::endpoint remoteEp_;
         asio::ip::udp::endpoint tempEp_;
 
-        std::map<uint16_t, Message<T>> m_futureMsgMap;
+        ReorderBuffer<Message<T>> m_reorder{RECV_WINDOW_SIZE};
+
+        PmtuProber m_pmtu{PMTU_BASE};
+        std::atomic<size_t> m_pathMtu = PMTU_BASE;
+        uint32_t m_probeAck = 0;
+
+        FecEncoder m_fec;
+        std::vector<asio::const_buffer> m_fecFrame;
+        std::deque<OutMessage> m_parityOut;
+        std::unique_ptr<FecCache> m_fecCache;
+        LossEstimator m_loss;
+        uint64_t m_lossSent = 0;
+        uint64_t m_lossLost = 0;
+        uint16_t m_recovered = 0;
+        std::minstd_rand m_lossShim{std::random_device{}()};
     };
 }
\ No newline at end of file
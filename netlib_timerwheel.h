@@ -0,0 +1,267 @@
+#pragma once
+
+#include "netlib_header.h"
+
+// Resolution of every session deadline, in milliseconds.
+uint16_t TIMER_WHEEL_TICK = 1;
+
+namespace netlib {
+
+    // Hierarchical hashed timer wheel (Varghese & Lauck), one per Server.
+    // Level L has 64 slots of 64^L ticks; a timer sits in the lowest level whose
+    // block still contains both now and its deadline, and moves down when that
+    // block starts. Arm and cancel are O(1) list operations, and one asio timer
+    // drives the whole wheel, sleeping until the next occupied slot.
+    class TimerWheel : public std::enable_shared_from_this<TimerWheel> {
+        static constexpr size_t BITS = 6;
+        static constexpr size_t SLOTS = 1 << BITS;
+        static constexpr size_t LEVELS = 5;
+
+        struct Node {
+            Node *prev = this;
+            Node *next = this;
+        };
+
+    public:
+        class Timer : private Node {
+        public:
+            // Callbacks are posted to executor, a strand keeps them serialized with the owner's other handlers.
+            Timer(std::shared_ptr<TimerWheel> wheel, asio::any_io_executor executor) :
+                    m_wheel(std::move(wheel)), m_executor(std::move(executor)), m_guard(std::make_shared<Guard>()) {}
+
+            explicit Timer(std::shared_ptr<TimerWheel> wheel) : Timer(wheel, wheel->m_driver.get_executor()) {}
+
+            Timer(const Timer &) = delete;
+
+            ~Timer() {
+                cancel();
+            }
+
+            // Replaces any pending deadline.
+            template<typename Rep, typename Period>
+            void start(std::chrono::duration<Rep, Period> after, std::function<void()> callback) {
+                startAt(std::chrono::steady_clock::now() + after, std::move(callback));
+            }
+
+            void startAt(std::chrono::steady_clock::time_point deadline, std::function<void()> callback) {
+                std::scoped_lock lock(m_wheel->m_mutex);
+                m_wheel->unlink(this);
+                m_guard->generation++;
+                m_guard->posted = false;
+                m_callback = std::move(callback);
+                m_deadline = m_wheel->toTick(deadline);
+                m_wheel->link(this);
+            }
+
+            // No callback runs once this returns, one already running elsewhere is waited for.
+            void cancel() {
+                {
+                    std::scoped_lock lock(m_wheel->m_mutex);
+                    m_wheel->unlink(this);
+                    m_guard->generation++;
+                    m_guard->posted = false;
+                    m_callback = nullptr;
+                }
+                std::scoped_lock running(m_guard->running);
+            }
+
+            // Also true between expiry and the callback actually running.
+            bool armed() const {
+                std::scoped_lock lock(m_wheel->m_mutex);
+                return next != this || m_guard->posted;
+            }
+
+        private:
+            friend class TimerWheel;
+
+            // Outlives the timer in posted callbacks, a stale generation means cancelled or restarted.
+            struct Guard {
+                std::recursive_mutex running;
+                uint64_t generation = 0;
+                bool posted = false;
+            };
+
+            std::shared_ptr<TimerWheel> m_wheel;
+            asio::any_io_executor m_executor;
+            std::shared_ptr<Guard> m_guard;
+            std::function<void()> m_callback;
+            uint64_t m_deadline = 0;
+            uint8_t m_level = 0;
+            uint8_t m_slot = 0;
+        };
+
+        static std::shared_ptr<TimerWheel> create(asio::io_context *context) {
+            return std::shared_ptr<TimerWheel>(new TimerWheel(context));
+        }
+
+        TimerWheel(const TimerWheel &) = delete;
+
+        size_t size() {
+            std::scoped_lock lock(m_mutex);
+            return m_size;
+        }
+
+    private:
+        explicit TimerWheel(asio::io_context *context) : m_driver(*context),
+                                                         m_epoch(std::chrono::steady_clock::now()) {}
+
+        static std::chrono::milliseconds tickLength() {
+            return std::chrono::milliseconds(std::max<uint16_t>(TIMER_WHEEL_TICK, 1));
+        }
+
+        // Deadlines round up, the clock rounds down, so nothing fires early.
+        uint64_t toTick(std::chrono::steady_clock::time_point time) const {
+            if (time <= m_epoch)
+                return 0;
+            return (time - m_epoch + tickLength() - std::chrono::nanoseconds(1)) / tickLength();
+        }
+
+        uint64_t currentTick() const {
+            return (std::chrono::steady_clock::now() - m_epoch) / tickLength();
+        }
+
+        std::chrono::steady_clock::time_point toTime(uint64_t tick) const {
+            return m_epoch + tick * tickLength();
+        }
+
+        void place(Timer *timer) {
+            uint64_t deadline = std::max(timer->m_deadline, m_now + 1);
+            size_t level = 0;
+            while (level + 1 < LEVELS && (deadline >> (BITS * (level + 1))) != (m_now >> (BITS * (level + 1))))
+                level++;
+            size_t slot = (deadline >> (BITS * level)) & (SLOTS - 1);
+            Node &head = m_slots[level][slot];
+            timer->prev = head.prev;
+            timer->next = &head;
+            head.prev->next = timer;
+            head.prev = timer;
+            timer->m_level = level;
+            timer->m_slot = slot;
+            m_occupied[level] |= uint64_t(1) << slot;
+        }
+
+        void link(Timer *timer) {
+            if (m_size == 0)
+                m_now = std::max(m_now, currentTick());
+            place(timer);
+            m_size++;
+            uint64_t wake = std::max(timer->m_deadline, m_now + 1);
+            if (wake < m_wakeTick)
+                armDriver(wake);
+        }
+
+        // Only list membership counts here, a posted callback was already unlinked by popFront.
+        void unlink(Timer *timer) {
+            if (timer->next == timer)
+                return;
+            timer->prev->next = timer->next;
+            timer->next->prev = timer->prev;
+            timer->prev = timer->next = timer;
+            Node &head = m_slots[timer->m_level][timer->m_slot];
+            if (head.next == &head)
+                m_occupied[timer->m_level] &= ~(uint64_t(1) << timer->m_slot);
+            m_size--;
+        }
+
+        Timer *popFront(size_t level, size_t slot) {
+            Node &head = m_slots[level][slot];
+            if (head.next == &head)
+                return nullptr;
+            Timer *timer = static_cast<Timer *>(head.next);
+            unlink(timer);
+            return timer;
+        }
+
+        // Moves the timers of the level slot that starts at m_now one level down.
+        void cascade(size_t level) {
+            size_t slot = (m_now >> (BITS * level)) & (SLOTS - 1);
+            while (Timer *timer = popFront(level, slot)) {
+                place(timer);
+                m_size++;
+            }
+        }
+
+        void step() {
+            m_now++;
+            for (size_t level = LEVELS - 1; level > 0; level--) {
+                if ((m_now & ((uint64_t(1) << (BITS * level)) - 1)) == 0)
+                    cascade(level);
+            }
+            size_t slot = m_now & (SLOTS - 1);
+            while (Timer *timer = popFront(0, slot))
+                fire(timer);
+        }
+
+        void fire(Timer *timer) {
+            if (!timer->m_callback)
+                return;
+            timer->m_guard->posted = true;
+            asio::post(timer->m_executor, [wheel = shared_from_this(), guard = timer->m_guard,
+                                           generation = timer->m_guard->generation,
+                                           callback = std::move(timer->m_callback)] () {
+                std::scoped_lock running(guard->running);
+                {
+                    std::scoped_lock lock(wheel->m_mutex);
+                    if (guard->generation != generation)
+                        return;
+                    guard->posted = false;
+                }
+                callback();
+            });
+        }
+
+        // First tick at which something is due or has to move down a level.
+        uint64_t nextWake() const {
+            uint64_t wake = UINT64_MAX;
+            for (size_t level = 0; level < LEVELS; level++) {
+                if (!m_occupied[level])
+                    continue;
+                size_t shift = BITS * level;
+                size_t current = (m_now >> shift) & (SLOTS - 1);
+                uint64_t ahead = current + 1 < SLOTS ? m_occupied[level] & (~uint64_t(0) << (current + 1)) : 0;
+                uint64_t block = (m_now >> (shift + BITS)) << (shift + BITS);
+                if (ahead)
+                    wake = std::min(wake, block + ((uint64_t)std::countr_zero(ahead) << shift));
+                else
+                    wake = std::min(wake, block + (uint64_t(1) << (shift + BITS)));
+            }
+            return wake;
+        }
+
+        void armDriver(uint64_t tick) {
+            m_wakeTick = tick;
+            m_driver.expires_at(toTime(tick));
+            m_driver.async_wait([weak = weak_from_this()] (std::error_code ec) {
+                std::shared_ptr<TimerWheel> wheel = weak.lock();
+                if (!ec && wheel)
+                    wheel->onDriver();
+            });
+        }
+
+        void onDriver() {
+            std::scoped_lock lock(m_mutex);
+            m_wakeTick = UINT64_MAX;
+            uint64_t target = currentTick();
+            // Empty stretches are skipped, every tick in between would have been a no-op.
+            while (m_size > 0) {
+                uint64_t next = nextWake();
+                if (next > target)
+                    break;
+                m_now = next - 1;
+                step();
+            }
+            m_now = std::max(m_now, target);
+            if (m_size > 0)
+                armDriver(nextWake());
+        }
+
+        mutable std::recursive_mutex m_mutex;
+        asio::steady_timer m_driver;
+        std::chrono::steady_clock::time_point m_epoch;
+        uint64_t m_now = 0;
+        uint64_t m_wakeTick = UINT64_MAX;
+        size_t m_size = 0;
+        std::array<std::array<Node, SLOTS>, LEVELS> m_slots;
+        std::array<uint64_t, LEVELS> m_occupied{};
+    };
+}
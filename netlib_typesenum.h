@@ -31,5 +31,9 @@ namespace netlib {
         PathResponsePullMsgType,
         PathAddressPushMsgType,
 
+        // New types go last, ids already on the wire must not move.
+        FileCancelMsgType,
+        FileHaveMsgType,
+
     };
 }
@@ -0,0 +1,707 @@
+#pragma once
+
+#include "netlib_header.h"
+#include "netlib_batchio.h"
+
+#if defined(NETLIB_BATCH_IO) && !defined(NETLIB_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Multishot recvmsg came with the 6.0 headers, as did the rest this needs; older ones build without io_uring.
+#ifdef IORING_RECV_MULTISHOT
+#define NETLIB_IO_URING
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+
+// Multiplexed sockets and piece files go through io_uring, anything the kernel refuses stays on the reactor and fstream.
+bool USE_IO_URING = false;
+uint32_t URING_ENTRIES = 256;
+// Provided receive buffers of a socket ring, rounded up to a power of two.
+uint16_t URING_RECV_BUFFERS = 64;
+// Registered buffers piece reads and writes are staged in.
+uint16_t URING_FILE_SLOTS = 32;
+uint32_t URING_FILE_SLOT_SIZE = 1 << 16;
+// Slots a piece being read keeps in flight ahead of the reader.
+uint16_t URING_READ_AHEAD = 4;
+
+namespace netlib {
+
+#ifdef NETLIB_IO_URING
+
+    // io_uring over the raw syscalls. One owner prepares, submits and reaps, nothing here is thread-safe.
+    class Uring {
+    public:
+        static std::unique_ptr<Uring> create(unsigned entries) {
+            std::unique_ptr<Uring> ring(new Uring());
+            if (!ring->setup(entries))
+                return nullptr;
+            return ring;
+        }
+
+        Uring(const Uring &) = delete;
+
+        ~Uring() {
+            if (m_sqes)
+                ::munmap(m_sqes, m_sqesSize);
+            if (m_cqRing && m_cqRing != m_sqRing)
+                ::munmap(m_cqRing, m_cqSize);
+            if (m_sqRing)
+                ::munmap(m_sqRing, m_sqSize);
+            if (m_fd >= 0)
+                ::close(m_fd);
+        }
+
+        // A zeroed entry, submitting the queued ones first if the ring is full. nullptr if it stays full.
+        io_uring_sqe *sqe() {
+            if (m_sqeTail - load(m_sqHead) >= m_sqEntries) {
+                submit();
+                if (m_sqeTail - load(m_sqHead) >= m_sqEntries)
+                    return nullptr;
+            }
+            io_uring_sqe *entry = &m_sqes[m_sqeTail++ & m_sqMask];
+            std::memset(entry, 0, sizeof(io_uring_sqe));
+            return entry;
+        }
+
+        // One syscall for everything queued, blocking until waitFor completions are ready.
+        int submit(unsigned waitFor = 0) {
+            store(m_sqTail, m_sqeTail);
+            unsigned pending = m_sqeTail - load(m_sqHead);
+            if (pending == 0 && waitFor == 0)
+                return 0;
+            while (true) {
+                int result = ::syscall(__NR_io_uring_enter, m_fd, pending, waitFor,
+                                       waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+                if (result >= 0 || errno != EINTR)
+                    return result;
+                pending = m_sqeTail - load(m_sqHead);
+            }
+        }
+
+        // Hands every ready completion to onCompletion, which may prepare new entries.
+        template<typename F>
+        unsigned reap(F &&onCompletion) {
+            unsigned count = 0;
+            for (unsigned head = *m_cqHead; head != load(m_cqTail); head++, count++) {
+                io_uring_cqe cqe = m_cqes[head & m_cqMask];
+                store(m_cqHead, head + 1);
+                onCompletion(cqe);
+            }
+            return count;
+        }
+
+        bool registerBuffers(const std::vector<iovec> &buffers) {
+            return reg(IORING_REGISTER_BUFFERS, buffers.data(), buffers.size());
+        }
+
+        bool registerBufferRing(io_uring_buf_reg &ring) {
+            return reg(IORING_REGISTER_PBUF_RING, &ring, 1);
+        }
+
+        bool registerEventFd(int fd) {
+            return reg(IORING_REGISTER_EVENTFD, &fd, 1);
+        }
+
+    private:
+        Uring() = default;
+
+        static unsigned load(const unsigned *value) {
+            return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+        }
+
+        static void store(unsigned *value, unsigned to) {
+            __atomic_store_n(value, to, __ATOMIC_RELEASE);
+        }
+
+        bool reg(unsigned opcode, const void *arg, unsigned count) {
+            return ::syscall(__NR_io_uring_register, m_fd, opcode, arg, count) == 0;
+        }
+
+        uint8_t *map(size_t size, off_t offset) {
+            void *memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+            return memory == MAP_FAILED ? nullptr : static_cast<uint8_t *>(memory);
+        }
+
+        bool setup(unsigned entries) {
+            io_uring_params params{};
+            m_fd = ::syscall(__NR_io_uring_setup, entries, &params);
+            if (m_fd < 0)
+                return false;
+            m_sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single)
+                m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+            m_sqRing = map(m_sqSize, IORING_OFF_SQ_RING);
+            m_cqRing = single ? m_sqRing : map(m_cqSize, IORING_OFF_CQ_RING);
+            m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            m_sqes = reinterpret_cast<io_uring_sqe *>(map(m_sqesSize, IORING_OFF_SQES));
+            if (!m_sqRing || !m_cqRing || !m_sqes)
+                return false;
+
+            m_sqHead = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.head);
+            m_sqTail = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.tail);
+            m_sqMask = *reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.ring_mask);
+            m_sqEntries = params.sq_entries;
+            // Entries are used in ring order, so the indirection array is the identity once and for all.
+            unsigned *array = reinterpret_cast<unsigned *>(m_sqRing + params.sq_off.array);
+            for (unsigned i = 0; i < m_sqEntries; i++)
+                array[i] = i;
+            m_sqeTail = *m_sqTail;
+
+            m_cqHead = reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.head);
+            m_cqTail = reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.tail);
+            m_cqMask = *reinterpret_cast<unsigned *>(m_cqRing + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe *>(m_cqRing + params.cq_off.cqes);
+            return true;
+        }
+
+        int m_fd = -1;
+        uint8_t *m_sqRing = nullptr;
+        uint8_t *m_cqRing = nullptr;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sqSize = 0;
+        size_t m_cqSize = 0;
+        size_t m_sqesSize = 0;
+
+        unsigned *m_sqHead = nullptr;
+        unsigned *m_sqTail = nullptr;
+        unsigned m_sqMask = 0;
+        unsigned m_sqEntries = 0;
+        unsigned m_sqeTail = 0;
+
+        unsigned *m_cqHead = nullptr;
+        unsigned *m_cqTail = nullptr;
+        unsigned m_cqMask = 0;
+        io_uring_cqe *m_cqes = nullptr;
+    };
+
+    // A ring whose completions run on an executor. The reactor only watches the ring's
+    // eventfd, one wakeup drains every completion that arrived in the meantime.
+    // Everything but create() must run on that executor.
+    class UringLoop {
+    public:
+        // Gets each completion of its entry, returns whether more will follow.
+        using Handler = std::function<bool(const io_uring_cqe &)>;
+        using DatagramHandler = std::function<void(const asio::ip::udp::endpoint &, const uint8_t *, size_t)>;
+
+        static std::unique_ptr<UringLoop> create(asio::any_io_executor executor) {
+            std::unique_ptr<Uring> ring = Uring::create(URING_ENTRIES);
+            if (!ring)
+                return nullptr;
+            int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (event < 0)
+                return nullptr;
+            if (!ring->registerEventFd(event)) {
+                ::close(event);
+                return nullptr;
+            }
+            return std::unique_ptr<UringLoop>(new UringLoop(std::move(executor), std::move(ring), event));
+        }
+
+        UringLoop(const UringLoop &) = delete;
+
+        ~UringLoop() {
+            m_ring.reset();
+            if (m_bufferRing)
+                ::munmap(m_bufferRing, m_bufferCount * sizeof(io_uring_buf));
+        }
+
+        // nullptr if the ring is full even after submitting.
+        io_uring_sqe *prepare(Handler handler) {
+            io_uring_sqe *entry = m_ring->sqe();
+            if (!entry)
+                return nullptr;
+            entry->user_data = ++m_nextToken;
+            m_handlers.emplace(m_nextToken, std::move(handler));
+            return entry;
+        }
+
+        void submit() {
+            m_ring->submit();
+        }
+
+        // Keeps one multishot RECVMSG armed on socket, the kernel picks a provided buffer per datagram.
+        // False if the kernel has no provided buffer rings, the socket then needs another reader.
+        bool receive(int socket, size_t datagramSize, DatagramHandler onDatagram) {
+            if (!provideBuffers(datagramSize))
+                return false;
+            m_recvSocket = socket;
+            m_onDatagram = std::move(onDatagram);
+            m_recvHeader = {};
+            m_recvHeader.msg_namelen = sizeof(sockaddr_storage);
+            m_recvHeader.msg_controllen = sizeof(ControlBuffer);
+            armReceive();
+            submit();
+            return true;
+        }
+
+        // One SENDMSG per header, all in one submission. done gets the first errno, 0 if all went out.
+        void sendmsg(int socket, std::vector<mmsghdr> &headers, std::function<void(int)> done) {
+            struct Batch {
+                size_t remaining;
+                int error = 0;
+                std::function<void(int)> done;
+            };
+            std::shared_ptr<Batch> batch = std::make_shared<Batch>(Batch{headers.size(), 0, std::move(done)});
+            for (mmsghdr &header: headers) {
+                io_uring_sqe *entry = prepare([batch] (const io_uring_cqe &cqe) {
+                    if (cqe.res < 0 && batch->error == 0)
+                        batch->error = -cqe.res;
+                    if (--batch->remaining == 0)
+                        batch->done(batch->error);
+                    return false;
+                });
+                if (!entry) {
+                    batch->error = batch->error ? batch->error : EBUSY;
+                    if (--batch->remaining == 0)
+                        batch->done(batch->error);
+                    continue;
+                }
+                entry->opcode = IORING_OP_SENDMSG;
+                entry->fd = socket;
+                entry->addr = reinterpret_cast<uint64_t>(&header.msg_hdr);
+                entry->len = 1;
+            }
+            submit();
+        }
+
+    private:
+        static constexpr uint16_t BUFFER_GROUP = 0;
+
+        UringLoop(asio::any_io_executor executor, std::unique_ptr<Uring> ring, int event) :
+                m_event(std::move(executor), event), m_ring(std::move(ring)) {
+            watch();
+        }
+
+        void watch() {
+            m_event.async_wait(asio::posix::stream_descriptor::wait_read, [this] (std::error_code er) {
+                if (er)
+                    return;
+                // Reset before reaping, a completion landing in between wakes us again. Without
+                // EFD_SEMAPHORE one read takes the whole count.
+                uint64_t value;
+                ::read(m_event.native_handle(), &value, sizeof(value));
+                m_ring->reap([this] (const io_uring_cqe &cqe) {
+                    auto it = m_handlers.find(cqe.user_data);
+                    if (it != m_handlers.end() && !it->second(cqe))
+                        m_handlers.erase(cqe.user_data);
+                });
+                submit();
+                watch();
+            });
+        }
+
+        bool provideBuffers(size_t datagramSize) {
+            m_bufferCount = std::bit_ceil<uint32_t>(std::max<uint16_t>(URING_RECV_BUFFERS, 1));
+            m_bufferSize = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + sizeof(ControlBuffer) + datagramSize;
+            void *ring = ::mmap(nullptr, m_bufferCount * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ring == MAP_FAILED)
+                return false;
+            m_bufferRing = static_cast<io_uring_buf *>(ring);
+            io_uring_buf_reg reg{};
+            reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+            reg.ring_entries = m_bufferCount;
+            reg.bgid = BUFFER_GROUP;
+            if (!m_ring->registerBufferRing(reg))
+                return false;
+            m_buffers.resize(m_bufferCount * m_bufferSize);
+            for (uint32_t i = 0; i < m_bufferCount; i++)
+                recycle(i);
+            return true;
+        }
+
+        // The ring tail shares its slot with the first entry's resv field.
+        void recycle(uint16_t id) {
+            io_uring_buf &buffer = m_bufferRing[m_bufferTail & (m_bufferCount - 1)];
+            buffer.addr = reinterpret_cast<uint64_t>(m_buffers.data() + id * m_bufferSize);
+            buffer.len = m_bufferSize;
+            buffer.bid = id;
+            __atomic_store_n(&m_bufferRing[0].resv, ++m_bufferTail, __ATOMIC_RELEASE);
+        }
+
+        void armReceive() {
+            io_uring_sqe *entry = prepare([this] (const io_uring_cqe &cqe) { return onReceive(cqe); });
+            if (!entry)
+                return;
+            entry->opcode = IORING_OP_RECVMSG;
+            entry->fd = m_recvSocket;
+            entry->addr = reinterpret_cast<uint64_t>(&m_recvHeader);
+            entry->len = 1;
+            entry->ioprio = IORING_RECV_MULTISHOT;
+            entry->flags = IOSQE_BUFFER_SELECT;
+            entry->buf_group = BUFFER_GROUP;
+        }
+
+        bool onReceive(const io_uring_cqe &cqe) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe.res > 0)
+                    deliver(m_buffers.data() + id * m_bufferSize, cqe.res);
+                recycle(id);
+            }
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            // Out of buffers or ended by the kernel: rearm. Anything else means the socket is gone.
+            if (!more && (cqe.res >= 0 || cqe.res == -ENOBUFS))
+                armReceive();
+            return more;
+        }
+
+        // Layout: io_uring_recvmsg_out, the name and control areas sized as in m_recvHeader, the payload.
+        void deliver(const uint8_t *buffer, size_t length) {
+            io_uring_recvmsg_out out;
+            std::memcpy(&out, buffer, sizeof(out));
+            const uint8_t *name = buffer + sizeof(io_uring_recvmsg_out);
+            uint8_t *control = const_cast<uint8_t *>(name) + m_recvHeader.msg_namelen;
+            const uint8_t *payload = control + m_recvHeader.msg_controllen;
+            if ((out.flags & MSG_TRUNC) || payload + out.payloadlen > buffer + length)
+                return;
+            asio::ip::udp::endpoint from;
+            size_t addrLen = std::min<size_t>({out.namelen, m_recvHeader.msg_namelen, from.capacity()});
+            std::memcpy(from.data(), name, addrLen);
+            from.resize(addrLen);
+            msghdr header{};
+            header.msg_control = control;
+            header.msg_controllen = std::min<size_t>(out.controllen, m_recvHeader.msg_controllen);
+            size_t segment = groSegment(header);
+            if (segment == 0)
+                segment = out.payloadlen;
+            for (size_t offset = 0; offset < out.payloadlen; offset += segment)
+                m_onDatagram(from, payload + offset, std::min<size_t>(segment, out.payloadlen - offset));
+        }
+
+        asio::posix::stream_descriptor m_event;
+        std::unique_ptr<Uring> m_ring;
+        uint64_t m_nextToken = 0;
+        std::unordered_map<uint64_t, Handler> m_handlers;
+
+        int m_recvSocket = -1;
+        msghdr m_recvHeader{};
+        DatagramHandler m_onDatagram;
+        io_uring_buf *m_bufferRing = nullptr;
+        uint32_t m_bufferCount = 0;
+        uint16_t m_bufferTail = 0;
+        size_t m_bufferSize = 0;
+        std::vector<uint8_t> m_buffers;
+    };
+
+    // Piece file I/O for the one thread that owns it. Data is staged in registered slots
+    // and moved with READ_FIXED/WRITE_FIXED; writes queue up until flush(), only a reader
+    // that catches up with its read-ahead waits.
+    class UringFiles {
+    public:
+        static std::unique_ptr<UringFiles> create() {
+            std::unique_ptr<Uring> ring = Uring::create(URING_ENTRIES);
+            if (!ring)
+                return nullptr;
+            std::unique_ptr<UringFiles> files(new UringFiles(std::move(ring)));
+            if (!files->m_ring->registerBuffers(files->m_iov))
+                return nullptr;
+            return files;
+        }
+
+        UringFiles(const UringFiles &) = delete;
+
+        int open(const std::string &path, bool write, bool truncate = true) {
+            if (write)
+                return ::open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0) | O_CLOEXEC, 0644);
+            return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+
+        // Waits for the file's queued writes first.
+        void close(int fd) {
+            flush();
+            while (m_inFlight[fd] > 0)
+                waitOne();
+            m_inFlight.erase(fd);
+            ::close(fd);
+        }
+
+        // The data is copied, a failed write shows up in the piece's SHA-1 check.
+        void write(int fd, uint64_t offset, const char *data, size_t length) {
+            while (length > 0) {
+                size_t part = std::min<size_t>(length, URING_FILE_SLOT_SIZE);
+                uint16_t slot;
+                if (acquire(slot)) {
+                    std::memcpy(m_slots[slot].data, data, part);
+                    queue(IORING_OP_WRITE_FIXED, fd, slot, offset, part);
+                } else if (::pwrite(fd, data, part, offset) < 0) {
+                    return;
+                }
+                data += part;
+                offset += part;
+                length -= part;
+            }
+        }
+
+        // Starts reading up to one slot at offset, false if every slot is taken.
+        bool read(int fd, uint64_t offset, size_t length, uint16_t &slot) {
+            if (m_free.empty() || !acquire(slot))
+                return false;
+            queue(IORING_OP_READ_FIXED, fd, slot, offset, std::min<size_t>(length, URING_FILE_SLOT_SIZE));
+            return true;
+        }
+
+        // Bytes the read into slot got, or -errno. Waits until it completes.
+        int result(uint16_t slot) {
+            while (!m_slots[slot].done) {
+                flush();
+                waitOne();
+            }
+            return m_slots[slot].result;
+        }
+
+        const char *data(uint16_t slot) const {
+            return m_slots[slot].data;
+        }
+
+        void release(uint16_t slot) {
+            m_free.push_back(slot);
+        }
+
+        void flush() {
+            m_ring->submit();
+        }
+
+    private:
+        struct Slot {
+            char *data;
+            int fd = -1;
+            bool write = false;
+            bool done = true;
+            int result = 0;
+        };
+
+        explicit UringFiles(std::unique_ptr<Uring> ring) : m_ring(std::move(ring)),
+                m_arena(size_t(URING_FILE_SLOTS) * URING_FILE_SLOT_SIZE) {
+            for (uint16_t i = 0; i < URING_FILE_SLOTS; i++) {
+                m_slots.push_back({m_arena.data() + size_t(i) * URING_FILE_SLOT_SIZE});
+                m_iov.push_back({m_slots.back().data, URING_FILE_SLOT_SIZE});
+                m_free.push_back(i);
+            }
+        }
+
+        // Waits for a write to free a slot while any is in flight, false once none is left to wait for.
+        bool acquire(uint16_t &slot) {
+            while (m_free.empty()) {
+                if (m_pending == 0)
+                    return false;
+                flush();
+                waitOne();
+            }
+            slot = m_free.back();
+            m_free.pop_back();
+            return true;
+        }
+
+        void queue(uint8_t opcode, int fd, uint16_t slot, uint64_t offset, size_t length) {
+            io_uring_sqe *entry = m_ring->sqe();
+            Slot &state = m_slots[slot];
+            if (!entry) {
+                // Ring full and not draining, do it in place.
+                ssize_t result = opcode == IORING_OP_WRITE_FIXED ? ::pwrite(fd, state.data, length, offset)
+                                                                 : ::pread(fd, state.data, length, offset);
+                state = {state.data, fd, false, true, result < 0 ? -errno : (int)result};
+                if (opcode == IORING_OP_WRITE_FIXED)
+                    release(slot);
+                return;
+            }
+            entry->opcode = opcode;
+            entry->fd = fd;
+            entry->addr = reinterpret_cast<uint64_t>(state.data);
+            entry->len = length;
+            entry->off = offset;
+            entry->buf_index = slot;
+            entry->user_data = slot;
+            state = {state.data, fd, opcode == IORING_OP_WRITE_FIXED, false, 0};
+            m_inFlight[fd]++;
+            m_pending++;
+        }
+
+        void waitOne() {
+            m_ring->submit(1);
+            m_ring->reap([this] (const io_uring_cqe &cqe) {
+                Slot &state = m_slots[cqe.user_data];
+                state.done = true;
+                state.result = cqe.res;
+                m_inFlight[state.fd]--;
+                m_pending--;
+                if (state.write)
+                    release(cqe.user_data);
+            });
+        }
+
+        std::unique_ptr<Uring> m_ring;
+        std::vector<char> m_arena;
+        std::vector<Slot> m_slots;
+        std::vector<iovec> m_iov;
+        std::vector<uint16_t> m_free;
+        std::unordered_map<int, size_t> m_inFlight;
+        size_t m_pending = 0;
+    };
+
+#else
+
+    class UringFiles {
+    public:
+        static std::unique_ptr<UringFiles> create() {
+            return nullptr;
+        }
+
+        void flush() {}
+    };
+
+#endif
+
+    // A piece file read or written front to back, through UringFiles when given one, std::fstream otherwise.
+    class PieceFile {
+    public:
+        PieceFile() = default;
+
+        PieceFile(const PieceFile &) = delete;
+
+        ~PieceFile() {
+            close();
+        }
+
+        // Without truncate an existing file is written over in place.
+        void open(const std::string &path, bool write, UringFiles *io = nullptr, bool truncate = true) {
+            close();
+            m_offset = 0;
+#ifdef NETLIB_IO_URING
+            if (io) {
+                m_fd = io->open(path, write, truncate);
+                struct stat info{};
+                if (m_fd >= 0 && ::fstat(m_fd, &info) == 0) {
+                    m_io = io;
+                    m_size = info.st_size;
+                    m_readOffset = 0;
+                    m_used = 0;
+                    return;
+                }
+                if (m_fd >= 0)
+                    ::close(m_fd);
+                m_fd = -1;
+            }
+#endif
+            std::ios::openmode mode = write ? std::ios::out : std::ios::in;
+            if (write && !truncate && std::filesystem::exists(path))
+                mode |= std::ios::in;
+            m_stream.open(path, std::ios::binary | mode);
+        }
+
+        bool isOpen() const {
+#ifdef NETLIB_IO_URING
+            if (m_io)
+                return true;
+#endif
+            return m_stream.is_open();
+        }
+
+        uint64_t offset() const {
+            return m_offset;
+        }
+
+        size_t read(char *out, size_t length) {
+#ifdef NETLIB_IO_URING
+            if (m_io)
+                return readRing(out, length);
+#endif
+            m_stream.read(out, length);
+            m_offset += m_stream.gcount();
+            return m_stream.gcount();
+        }
+
+        void write(const char *data, size_t length) {
+            m_offset += length;
+#ifdef NETLIB_IO_URING
+            if (m_io) {
+                m_io->write(m_fd, m_offset - length, data, length);
+                return;
+            }
+#endif
+            m_stream.write(data, length);
+        }
+
+        void close() {
+#ifdef NETLIB_IO_URING
+            if (m_io) {
+                for (Ahead &ahead: m_ahead) {
+                    m_io->result(ahead.slot);
+                    m_io->release(ahead.slot);
+                }
+                m_ahead.clear();
+                m_io->close(m_fd);
+                m_io = nullptr;
+                m_fd = -1;
+                return;
+            }
+#endif
+            if (m_stream.is_open())
+                m_stream.close();
+        }
+
+    private:
+#ifdef NETLIB_IO_URING
+        struct Ahead {
+            uint16_t slot;
+            size_t length;
+        };
+
+        size_t readRing(char *out, size_t length) {
+            size_t done = 0;
+            while (done < length) {
+                while (m_ahead.size() < std::max<uint16_t>(URING_READ_AHEAD, 1) && m_readOffset < m_size) {
+                    Ahead ahead{0, std::min<size_t>(m_size - m_readOffset, URING_FILE_SLOT_SIZE)};
+                    if (!m_io->read(m_fd, m_readOffset, ahead.length, ahead.slot))
+                        break;
+                    m_ahead.push_back(ahead);
+                    m_readOffset += ahead.length;
+                }
+                m_io->flush();
+                if (m_ahead.empty()) {
+                    // Every slot is busy with other pieces.
+                    ssize_t result = m_offset < m_size ? ::pread(m_fd, out + done, length - done, m_offset) : 0;
+                    if (result <= 0)
+                        break;
+                    done += result;
+                    m_offset += result;
+                    m_readOffset = m_offset;
+                    continue;
+                }
+                Ahead &front = m_ahead.front();
+                if (m_io->result(front.slot) != (int)front.length) {
+                    // A short or failed read ends the piece, the receiver's SHA-1 check rejects it.
+                    m_size = m_offset;
+                    break;
+                }
+                size_t part = std::min(front.length - m_used, length - done);
+                std::memcpy(out + done, m_io->data(front.slot) + m_used, part);
+                m_used += part;
+                done += part;
+                m_offset += part;
+                if (m_used == front.length) {
+                    m_io->release(front.slot);
+                    m_ahead.pop_front();
+                    m_used = 0;
+                }
+            }
+            return done;
+        }
+
+        UringFiles *m_io = nullptr;
+        int m_fd = -1;
+        uint64_t m_size = 0;
+        uint64_t m_readOffset = 0;
+        size_t m_used = 0;
+        std::deque<Ahead> m_ahead;
+#endif
+        std::fstream m_stream;
+        uint64_t m_offset = 0;
+    };
+}
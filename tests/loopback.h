@@ -0,0 +1,117 @@
+#pragma once
+
+#include "../netlib.h"
+
+using namespace netlib;
+
+// Shared by the tests and benchmarks: an io_context run by a few threads, loopback sockets and
+// Sessions on them that already talk to each other. Everything is torn down with the fixture.
+
+inline int failures = 0;
+
+inline void check(bool ok, const char *what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+// Polls until the condition holds or timeout passes.
+template<typename F>
+bool waitFor(F condition, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+struct SessionPair {
+    std::shared_ptr<Session<TypesEnum>> sender;
+    std::shared_ptr<Session<TypesEnum>> receiver;
+};
+
+class Loopback {
+public:
+    explicit Loopback(uint16_t threads = 1) : m_work(asio::make_work_guard(context)) {
+        // Sessions resolve it up front, nothing here talks to it.
+        STUN_HOST = "127.0.0.1";
+        for (uint16_t i = 0; i < std::max<uint16_t>(threads, 1); i++)
+            m_runners.emplace_back([this] () { context.run(); });
+    }
+
+    Loopback(const Loopback &) = delete;
+
+    ~Loopback() {
+        for (auto &session: m_sessions)
+            session->asyncDisconnect();
+        m_work.reset();
+        context.stop();
+        for (std::thread &runner: m_runners)
+            runner.join();
+    }
+
+    asio::ip::udp::socket socket() {
+        return asio::ip::udp::socket(context, asio::ip::udp::endpoint(asio::ip::address_v4::loopback(), 0));
+    }
+
+    // A Session on its own socket, dialling peer. Whatever it receives lands in queueIn.
+    std::shared_ptr<Session<TypesEnum>> session(asio::ip::udp::socket &&socket, int id, const asio::ip::udp::endpoint &peer) {
+        auto session = std::make_shared<Session<TypesEnum>>(&context, queueIn, std::move(socket), id, TypesEnum::PongMsgType);
+        session->connectWithEndpoint(peer, TypesEnum::PingMsgType);
+        m_sessions.push_back(session);
+        return session;
+    }
+
+    // Two Sessions dialling each other, returned once both are active. The receiver gets id.
+    SessionPair pair(int id) {
+        asio::ip::udp::socket from = socket(), to = socket();
+        asio::ip::udp::endpoint fromEp = from.local_endpoint(), toEp = to.local_endpoint();
+        SessionPair pair{session(std::move(from), -1 - id, toEp), session(std::move(to), id, fromEp)};
+        waitFor([&] () { return pair.sender->isActive() && pair.receiver->isActive(); }, std::chrono::seconds(5));
+        return pair;
+    }
+
+    // Sends messages FileBody chunks from the sender of every pair, at most window of them unreceived
+    // per pair, and returns once all arrived. Receivers must have ids 0 to pairs.size() - 1.
+    void stream(const std::vector<SessionPair> &pairs, int messages, int window) {
+        std::vector<char> chunk(FILE_CHUNK_SIZE, 'x');
+        std::vector<int> sent(pairs.size(), 0), received(pairs.size(), 0);
+        size_t total = 0;
+        while (total < pairs.size() * messages) {
+            for (size_t i = 0; i < pairs.size(); i++) {
+                for (; sent[i] < messages && sent[i] - received[i] < window; sent[i]++) {
+                    Message<TypesEnum> msg(TypesEnum::FileBodyMsgType);
+                    msg << chunk << uint16_t(0) << uint16_t(0);
+                    pairs[i].sender->send(std::move(msg));
+                }
+            }
+            bool idle = true;
+            while (!queueIn.empty()) {
+                OwnedMessage<TypesEnum> owned = queueIn.pop_front();
+                int id = owned.session_->getId();
+                if (owned.msg_.getId() == TypesEnum::FileBodyMsgType && id >= 0 && id < (int)pairs.size()) {
+                    received[id]++;
+                    total++;
+                }
+                idle = false;
+            }
+            if (idle)
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    std::thread &runner(size_t i = 0) {
+        return m_runners[i];
+    }
+
+    asio::io_context context;
+    MpscQueue<OwnedMessage<TypesEnum>> queueIn;
+
+private:
+    asio::executor_work_guard<asio::io_context::executor_type> m_work;
+    std::vector<std::thread> m_runners;
+    std::vector<std::shared_ptr<Session<TypesEnum>>> m_sessions;
+};
@@ -0,0 +1,26 @@
+#include "loopback.h"
+
+// Streams messages between two Sessions on loopback while every end drops a share of what it
+// receives. Every message must arrive, the sender must start sending parity once it measures the
+// loss and the receiver must rebuild some frames from it.
+
+static const int MESSAGES = 4000;
+
+int main() {
+    SIMULATED_LOSS = 0.05;
+    // Ethernet sized datagrams carry a frame each, at the loopback MTU one drop takes whole parity classes.
+    MAX_PACKET_SIZE = 1400;
+    Loopback loopback;
+    SessionPair pair = loopback.pair(0);
+    check(pair.sender->isActive() && pair.receiver->isActive(), "sessions become active under loss");
+
+    loopback.stream({pair}, MESSAGES, 256);
+
+    check(pair.sender->getStats().paritySent > 0, "sender adds parity once it sees loss");
+    check(pair.receiver->getStats().recovered > 0, "receiver rebuilds lost frames from parity");
+    if (failures == 0)
+        std::cout << "test_fec: ok, " << pair.sender->getStats().paritySent << " parity frames, "
+                  << pair.receiver->getStats().recovered << " recovered, "
+                  << pair.sender->getStats().retransmits << " retransmits\n";
+    return failures == 0 ? 0 : 1;
+}
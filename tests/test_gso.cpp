@@ -0,0 +1,63 @@
+#include "loopback.h"
+
+// Sends a run of equal datagrams and a short tail as one GSO super-buffer over loopback and reads
+// them back through a GRO receiver. Every datagram must come out whole, in order, with its size.
+
+int main() {
+#ifndef NETLIB_BATCH_IO
+    std::cout << "test_gso: skipped, no batched I/O\n";
+    return 0;
+#else
+    asio::io_context context;
+    asio::ip::udp::endpoint any(asio::ip::address_v4::loopback(), 0);
+    asio::ip::udp::socket from(context, any), to(context, any);
+    asio::ip::udp::endpoint toEp = to.local_endpoint();
+    if (!supportsGso(from)) {
+        std::cout << "test_gso: skipped, no UDP_SEGMENT\n";
+        return 0;
+    }
+
+    // Two gather buffers per datagram, a header carrying the index and the payload.
+    const size_t count = 40, segment = 1200, tail = 500;
+    std::vector<uint16_t> indexes(count);
+    std::vector<std::vector<uint8_t>> payloads(count);
+    std::vector<asio::const_buffer> buffers;
+    std::vector<size_t> ends;
+    for (size_t i = 0; i < count; i++) {
+        indexes[i] = i;
+        payloads[i].assign((i + 1 == count ? tail : segment) - sizeof(uint16_t), uint8_t(i * 7));
+        buffers.push_back(asio::buffer(&indexes[i], sizeof(uint16_t)));
+        buffers.push_back(asio::buffer(payloads[i]));
+        ends.push_back(buffers.size());
+    }
+
+    std::unique_ptr<BatchReceiver> receiver = BatchReceiver::forSocket(to, segment);
+    BatchSender sender;
+    sender.setGso(true);
+    sender.setSegmentLimit(segment);
+    check(sender.send(from, &toEp, buffers, ends, 0) == (int)count, "all datagrams sent in one call");
+    check(sender.hasGso(), "GSO was not turned off by the kernel");
+
+    size_t received = 0, reads = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (received < count && std::chrono::steady_clock::now() < deadline) {
+        int slots = receiver->receive(to, [&] (const asio::ip::udp::endpoint &, const uint8_t *data, size_t length) {
+            uint16_t index;
+            std::memcpy(&index, data, sizeof(index));
+            bool whole = index == received && length == (index + 1 == count ? tail : segment) &&
+                         std::all_of(data + sizeof(index), data + length, [&] (uint8_t b) { return b == uint8_t(index * 7); });
+            check(whole, "datagram comes out whole and in order");
+            received++;
+        });
+        check(slots >= 0, "receive does not fail");
+        if (slots > 0)
+            reads += slots;
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    check(received == count, "every datagram arrives");
+    if (failures == 0)
+        std::cout << "test_gso: ok, " << count << " datagrams in " << reads << " receive slots\n";
+    return failures == 0 ? 0 : 1;
+#endif
+}
@@ -0,0 +1,57 @@
+#include "loopback.h"
+
+// Feeds a Session pongs whose SACK ranges are too many, inverted or reach past anything sent.
+// The bad ones must be ignored, the overlong one clamped to the frames in flight.
+
+struct Range {
+    uint32_t begin;
+    uint32_t end;
+};
+
+static void sendPong(asio::ip::udp::socket &peer, const asio::ip::udp::endpoint &to, uint64_t cumAck,
+                     const std::vector<Range> &ranges) {
+    Message<TypesEnum> msg(TypesEnum::PongMsgType);
+    msg << ranges << cumAck << uint32_t(0) << uint16_t(0) << FrameKind::Control;
+    msg.m_header.size = msg.m_body.size();
+    std::vector<uint8_t> datagram(sizeof(msg.m_header) + msg.m_body.size());
+    std::memcpy(datagram.data(), &msg.m_header, sizeof(msg.m_header));
+    std::memcpy(datagram.data() + sizeof(msg.m_header), msg.m_body.data(), msg.m_body.size());
+    peer.send_to(asio::buffer(datagram), to);
+}
+
+static size_t inFlight(Session<TypesEnum> &session) {
+    return session.getStats().inFlight;
+}
+
+int main() {
+    Loopback loopback;
+    asio::ip::udp::socket peer = loopback.socket(), own = loopback.socket();
+    asio::ip::udp::endpoint ownEp = own.local_endpoint();
+    auto session = loopback.session(std::move(own), 1, peer.local_endpoint());
+
+    // Anything from the peer makes the session active, then four frames go out, ids 1 to 4.
+    sendPong(peer, ownEp, 0, {});
+    check(waitFor([&] () { return session->isActive(); }, std::chrono::seconds(2)), "session becomes active");
+    for (int i = 0; i < 4; i++) {
+        Message<TypesEnum> msg(TypesEnum::FileHaveMsgType);
+        msg << uint16_t(i) << uint16_t(0);
+        session->send(std::move(msg));
+    }
+    check(waitFor([&] () { return inFlight(*session) == 4; }, std::chrono::seconds(2)), "four frames in flight");
+
+    std::vector<Range> tooMany(MAX_SACK_RANGES + 1, Range{1, 1});
+    sendPong(peer, ownEp, 0, tooMany);
+    sendPong(peer, ownEp, 0, {{3, 1}});
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    check(inFlight(*session) == 4, "malformed pongs ack nothing");
+
+    // Unclamped this walks four billion ids on the strand.
+    auto start = std::chrono::steady_clock::now();
+    sendPong(peer, ownEp, 0, {{0, 0xFFFFFFFF}});
+    check(waitFor([&] () { return inFlight(*session) == 0; }, std::chrono::seconds(1)), "overlong range acks what is in flight");
+    check(std::chrono::steady_clock::now() - start < std::chrono::seconds(1), "overlong range is handled at once");
+
+    if (failures == 0)
+        std::cout << "test_sack: ok\n";
+    return failures == 0 ? 0 : 1;
+}
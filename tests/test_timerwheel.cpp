@@ -0,0 +1,40 @@
+#include "loopback.h"
+
+// Restarts and cancels a timer after it expired but before its posted callback ran, the wheel
+// must still count and fire the timers that stayed linked.
+
+int main() {
+    Loopback loopback;
+    asio::io_context &context = loopback.context;
+
+    // Callbacks go to their own context, left unrun until we poll it, so A expires and waits posted.
+    asio::io_context callbacks;
+    auto wheel = TimerWheel::create(&context);
+    TimerWheel::Timer a(wheel, callbacks.get_executor());
+    TimerWheel::Timer b(wheel, context.get_executor());
+    std::atomic<int> firedA{0}, firedB{0};
+    a.start(std::chrono::milliseconds(2), [&] () { firedA++; });
+    b.start(std::chrono::milliseconds(50), [&] () { firedB++; });
+    check(wheel->size() == 2, "two timers linked");
+
+    check(waitFor([&] () { return wheel->size() == 1; }, std::chrono::seconds(1)), "A expires");
+    check(a.armed(), "A counts as armed while its callback is posted");
+    a.start(std::chrono::milliseconds(500), [&] () { firedA++; });
+    check(wheel->size() == 2, "restart during the posted window links A once");
+    a.cancel();
+    check(wheel->size() == 1, "cancel during the posted window leaves B counted");
+    check(!a.armed(), "cancelled A is not armed");
+
+    check(waitFor([&] () { return firedB == 1; }, std::chrono::seconds(1)), "B still fires");
+    check(wheel->size() == 0, "wheel is empty after B");
+    callbacks.poll();
+    check(firedA == 0, "stale A callback does not run");
+
+    // A fresh timer after all that still fires on time.
+    a.start(std::chrono::milliseconds(5), [&] () { firedA++; });
+    check(waitFor([&] () { callbacks.restart(); callbacks.poll(); return firedA == 1; }, std::chrono::seconds(1)), "A fires after a restart");
+
+    if (failures == 0)
+        std::cout << "test_timerwheel: ok\n";
+    return failures == 0 ? 0 : 1;
+}